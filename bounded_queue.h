@@ -0,0 +1,55 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+
+// Queue between threads holding at most capacity items. push blocks while
+// the queue is full and pop while it is empty. After close, pushing fails
+// and pop fails once the remaining items were taken, which ends consumers.
+template <class T>
+class BoundedQueue {
+  public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+    // returns false if the queue was closed
+    bool push(T item) {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_full.wait(lock, [this]() { return closed || items.size() < capacity; });
+      if(closed) return false;
+      items.push_back(std::move(item));
+      lock.unlock();
+      not_empty.notify_one();
+      return true;
+    }
+
+    // returns false if the queue was closed and is empty
+    bool pop(T* item) {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+      if(items.empty()) return false;
+      *item = std::move(items.front());
+      items.pop_front();
+      lock.unlock();
+      not_full.notify_one();
+      return true;
+    }
+
+    void close() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+      }
+      not_full.notify_all();
+      not_empty.notify_all();
+    }
+
+  protected:
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
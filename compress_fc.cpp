@@ -0,0 +1,213 @@
+#include "utils.h"
+#include "device.h"
+#include "low_rank.h"
+
+#include <caffe/data_transformer.hpp>
+
+#include <gflags/gflags.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+
+const int n_outputs = 15;
+
+DEFINE_string(network_prototxt, "network_deploy.prototxt", "Prototxt describing network architecture.");
+DEFINE_string(network_caffemodel, "network_weights.caffemodel", "Caffemodel with the weights to use for network.");
+DEFINE_string(normalization_protobinary, "torcs_train_normalization.binaryproto", "Protobinary containing Blob with normalization parameters.");
+DEFINE_string(layers, "fc6,fc7", "Comma separated names of the InnerProduct layers to factorize.");
+DEFINE_int32(rank, 0, "Rank of the factorization of each layer. 0 to use the smallest rank retaining --energy.");
+DEFINE_double(energy, 0.9, "Fraction of the squared Frobenius norm of the weights to retain if --rank is 0.");
+DEFINE_int32(max_rank, 1024, "Maximum rank if --rank is 0.");
+DEFINE_string(output_prototxt, "network_deploy_lowrank.prototxt", "Prototxt to write the factorized network architecture to.");
+DEFINE_string(output_caffemodel, "network_weights_lowrank.caffemodel", "Caffemodel to write the weights of the factorized network to.");
+DEFINE_string(test_db, "torcs_test_input", "Database containing frames to compare the networks on.");
+DEFINE_string(test_target_db, "torcs_test_target", "Database containing ground truth for test_db.");
+DEFINE_int32(test_frames, 1000, "Number of frames to compare on. 0 for all.");
+DEFINE_string(device, "auto", "Device to run the networks on: auto, cpu, gpu or gpu:N.");
+DEFINE_int32(threads, 0, "Number of BLAS/OpenMP threads used on the CPU. 0 uses the library default.");
+
+
+// number of parameters of net
+long long count_parameters(const caffe::Net<float>& net)
+{
+  long long count = 0;
+  for(const auto& blob : net.params()) {
+    count += blob->count();
+  }
+  return count;
+}
+
+
+// Factorize InnerProduct layers of a trained network with a truncated SVD,
+// such that each of them is replaced by two thinner ones, and compare the
+// factorized network against the original one.
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Factorize fully connected layers of a trained network into low rank ones and report the effect on latency and accuracy.");
+
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  select_device(FLAGS_device);
+  set_compute_threads(FLAGS_threads);
+
+  // original network
+  caffe::NetParameter network_params;
+  caffe::ReadProtoFromTextFile(FLAGS_network_prototxt, &network_params);
+  caffe::Net<float> network(network_params);
+  caffe::NetParameter trained_network_params;
+  caffe::ReadNetParamsFromBinaryFileOrDie(FLAGS_network_caffemodel, &trained_network_params);
+  network.CopyTrainedLayersFrom(trained_network_params);
+
+  // factorize
+  std::map<std::string, LowRankFactorization> factorizations;
+  for(const auto& name : split_layer_names(FLAGS_layers)) {
+    CHECK(network.has_layer(name)) << "Unknown layer " << name;
+    auto layer = network.layer_by_name(name);
+    CHECK(std::string(layer->type()) == "InnerProduct") << name << " is not an InnerProduct layer.";
+    CHECK(!layer->layer_param().inner_product_param().transpose()) << "Transposed weights are not supported, see " << name;
+    const caffe::Blob<float>* weights = layer->blobs()[0].get();
+    int rows = weights->shape(0), cols = weights->count(1);
+    auto start = std::chrono::steady_clock::now();
+    factorizations[name] = factorize_low_rank(weights->cpu_data(), rows, cols, FLAGS_rank, FLAGS_energy, FLAGS_max_rank);
+    const auto& factorization = factorizations[name];
+    std::cout << name << ": " << rows << "x" << cols << " -> rank " << factorization.rank
+      << " retaining " << factorization.retained_energy(factorization.rank) << " of the energy, "
+      << rows * cols << " -> " << factorization.rank * (rows + cols) << " weights ("
+      << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s)" << std::endl;
+  }
+
+  // Replace layer X by X_lowrank (rank outputs, no bias) followed by X such
+  // that the names of all blobs stay the same.
+  caffe::NetParameter lowrank_params;
+  lowrank_params.CopyFrom(network_params);
+  lowrank_params.clear_layer();
+  for(int i = 0; i < network_params.layer_size(); ++i) {
+    const caffe::LayerParameter& layer = network_params.layer(i);
+    auto factorization = factorizations.find(layer.name());
+    if(factorization == factorizations.end()) {
+      lowrank_params.add_layer()->CopyFrom(layer);
+      continue;
+    }
+    caffe::LayerParameter* first = lowrank_params.add_layer();
+    first->CopyFrom(layer);
+    first->set_name(layer.name() + "_lowrank");
+    first->set_top(0, layer.name() + "_lowrank");
+    first->clear_param();
+    first->mutable_inner_product_param()->set_num_output(factorization->second.rank);
+    first->mutable_inner_product_param()->set_bias_term(false);
+    first->mutable_inner_product_param()->clear_bias_filler();
+    caffe::LayerParameter* second = lowrank_params.add_layer();
+    second->CopyFrom(layer);
+    second->set_bottom(0, layer.name() + "_lowrank");
+  }
+  caffe::Net<float> lowrank_network(lowrank_params);
+
+  // copy all weights but those of the factorized layers, which have a
+  // different shape now
+  caffe::NetParameter kept_params;
+  kept_params.CopyFrom(trained_network_params);
+  kept_params.clear_layer();
+  for(int i = 0; i < trained_network_params.layer_size(); ++i) {
+    if(factorizations.count(trained_network_params.layer(i).name()) == 0) {
+      kept_params.add_layer()->CopyFrom(trained_network_params.layer(i));
+    }
+  }
+  lowrank_network.CopyTrainedLayersFrom(kept_params);
+  for(const auto& factorization : factorizations) {
+    const std::string& name = factorization.first;
+    auto first = lowrank_network.layer_by_name(name + "_lowrank");
+    auto second = lowrank_network.layer_by_name(name);
+    auto original = network.layer_by_name(name);
+    std::copy(factorization.second.first.begin(), factorization.second.first.end(), first->blobs()[0]->mutable_cpu_data());
+    std::copy(factorization.second.second.begin(), factorization.second.second.end(), second->blobs()[0]->mutable_cpu_data());
+    if(original->blobs().size() > 1) {
+      caffe::Blob<float>* bias = original->blobs()[1].get();
+      std::copy(bias->cpu_data(), bias->cpu_data() + bias->count(), second->blobs()[1]->mutable_cpu_data());
+    }
+  }
+
+  caffe::WriteProtoToTextFile(lowrank_params, FLAGS_output_prototxt);
+  caffe::NetParameter lowrank_weights;
+  lowrank_network.ToProto(&lowrank_weights, false);
+  caffe::WriteProtoToBinaryFile(lowrank_weights, FLAGS_output_caffemodel);
+  std::cout << "Wrote " << FLAGS_output_prototxt << " and " << FLAGS_output_caffemodel << std::endl;
+
+  // compare on the test set
+  auto transformation_param = network.layers()[0]->layer_param().transform_param();
+  caffe::DataTransformer<float> transformer(transformation_param, caffe::TEST);
+  // targets are always normalized, outputs only if the network does not
+  // denormalize itself
+  LinearNormalizer<float> normalizer(FLAGS_normalization_protobinary);
+  const bool folded_normalization = has_folded_normalization(network);
+  leveldb::Options options;
+  options.error_if_exists = false;
+  options.create_if_missing = false;
+  options.max_open_files = 100;
+  auto test_db = open_leveldb(FLAGS_test_db, options);
+  auto test_target_db = open_leveldb_nofail(FLAGS_test_target_db, options);
+
+  caffe::Net<float>* networks[2] = {&network, &lowrank_network};
+  std::vector<double> seconds(2, 0);
+  std::vector<std::vector<double>> abs_error(2, std::vector<double>(n_outputs, 0));
+  std::vector<double> deviation(n_outputs, 0);
+  std::vector<float> outputs[2] = {std::vector<float>(n_outputs), std::vector<float>(n_outputs)};
+  caffe::Datum datum, target_datum;
+  caffe::Blob<float> target_blob(std::vector<int>{1, n_outputs});
+  auto it = test_db->NewIterator(leveldb::ReadOptions());
+  int count = 0;
+  for(it->SeekToFirst(); it->Valid() && (FLAGS_test_frames <= 0 || count < FLAGS_test_frames); it->Next()) {
+    datum.ParseFromString(it->value().ToString());
+    for(int n = 0; n < 2; ++n) {
+      caffe::Blob<float>* input_blob = networks[n]->input_blobs()[0];
+      caffe::Blob<float>* output_blob = networks[n]->output_blobs()[0];
+      CHECK(output_blob->count() == n_outputs) << "Expected " << n_outputs << " outputs.";
+      transformer.Transform(datum, input_blob);
+      auto start = std::chrono::steady_clock::now();
+      networks[n]->Forward();
+      // synchronizes with the GPU
+      const float* output_data = output_blob->cpu_data();
+      seconds[n] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if(!folded_normalization) normalizer.Denormalize(output_blob);
+      std::copy(output_data, output_data + n_outputs, outputs[n].begin());
+    }
+    for(int i = 0; i < n_outputs; ++i) {
+      deviation[i] += std::abs(outputs[1][i] - outputs[0][i]);
+    }
+    if(test_target_db != nullptr) {
+      std::string value;
+      auto status = test_target_db->Get(leveldb::ReadOptions(), it->key(), &value);
+      CHECK(status.ok()) << status.ToString();
+      target_datum.ParseFromString(value);
+      CHECK(target_datum.float_data_size() == n_outputs) << "Expected " << n_outputs << " targets.";
+      std::copy(target_datum.float_data().begin(), target_datum.float_data().end(), target_blob.mutable_cpu_data());
+      normalizer.Denormalize(&target_blob);
+      for(int n = 0; n < 2; ++n) {
+        for(int i = 0; i < n_outputs; ++i) {
+          abs_error[n][i] += std::abs(outputs[n][i] - target_blob.cpu_data()[i]);
+        }
+      }
+    }
+    count += 1;
+  }
+  delete it;
+  CHECK(count > 0) << "No frames to compare on in " << FLAGS_test_db;
+
+  std::cout << "Mean absolute errors over " << count << " frames in denormalized units (output "
+    << n_outputs - 1 << " is the steering command):" << std::endl;
+  std::cout << std::setw(8) << "output";
+  if(test_target_db != nullptr) std::cout << std::setw(14) << "original" << std::setw(14) << "lowrank";
+  std::cout << std::setw(14) << "deviation" << std::endl;
+  for(int i = 0; i < n_outputs; ++i) {
+    std::cout << std::setw(8) << i;
+    if(test_target_db != nullptr) std::cout << std::setw(14) << abs_error[0][i] / count << std::setw(14) << abs_error[1][i] / count;
+    std::cout << std::setw(14) << deviation[i] / count << std::endl;
+  }
+  for(int n = 0; n < 2; ++n) {
+    std::cout << (n == 0 ? "original" : "lowrank") << ": " << count_parameters(*networks[n]) << " parameters, "
+      << 1000 * seconds[n] / count << " ms per frame" << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <glog/logging.h>
+
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+// Non-blocking Unix datagram socket to receive control commands, one
+// command per datagram, e.g.
+//
+//     echo pause | socat - UNIX-SENDTO:/tmp/drive_torcs.sock
+class ControlSocket {
+  public:
+    explicit ControlSocket(const std::string& path) : path(path), fd(-1) {
+      struct sockaddr_un address;
+      CHECK(path.size() < sizeof(address.sun_path)) << "Socket path too long: " << path;
+      fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+      CHECK(fd != -1) << "socket() unsuccessful.";
+      CHECK(fcntl(fd, F_SETFL, O_NONBLOCK) == 0) << "fcntl() unsuccessful.";
+      memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+      strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+      unlink(path.c_str());
+      CHECK(bind(fd, (struct sockaddr*)&address, sizeof(address)) == 0) << "bind() unsuccessful for " << path;
+      LOG(INFO) << "Listening for control commands on " << path;
+    }
+
+    ~ControlSocket() {
+      close(fd);
+      unlink(path.c_str());
+    }
+
+    // receive the next pending command without blocking, returns false if
+    // there is none
+    bool receive(std::string* command) {
+      char buffer[256];
+      ssize_t size = recv(fd, buffer, sizeof(buffer), 0);
+      if(size <= 0) return false;
+      command->assign(buffer, size);
+      // strip trailing whitespace as sent by echo
+      command->erase(command->find_last_not_of(" \t\r\n") + 1);
+      return true;
+    }
+
+  protected:
+    std::string path;
+    int fd;
+};
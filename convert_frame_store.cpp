@@ -0,0 +1,73 @@
+#include "utils.h"
+#include "manifest.h"
+#include "frame_store.h"
+#include "datum_codec.h"
+
+#include <gflags/gflags.h>
+
+#include <iostream>
+#include <memory>
+
+DEFINE_int32(threads, 0, "Number of threads reading and decoding frames. 0 to use the number of cores.");
+
+// Convert a dataset of an input and a target leveldb as produced by
+// split.cpp into a frame store (see frame_store.h). Both dbs are read once
+// sequentially in lockstep and must have the same keys. Frames and targets
+// are written in the order of the keys. Encoded frames are decoded.
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Convert an input and a target database into a frame store.\n"
+                          "Usage: convert_frame_store [FLAGS] input_db target_db frame_store");
+
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if(argc != 4) {
+    LOG(ERROR) << "Usage: " << argv[0] << " input_db target_db frame_store";
+    return 1;
+  }
+
+  leveldb::Options options;
+  options.error_if_exists = false;
+  options.create_if_missing = false;
+  options.max_open_files = 100;
+  std::string input_dbname(argv[1]), target_dbname(argv[2]);
+  auto input_db = open_leveldb(input_dbname, options);
+  auto target_db = open_leveldb(target_dbname, options);
+  auto shape = dataset_manifest(input_dbname, input_db).shape();
+  auto float_data_size = dataset_manifest(target_dbname, target_db).float_data_size;
+  std::cout << "Inferred shape: " << shape[0] << " " << shape[1] << " " << shape[2] << std::endl;
+  std::cout << "Inferred float_data_size: " << float_data_size << std::endl;
+  CHECK(float_data_size > 0) << "Can not convert targets without float data.";
+
+  // the dbs are read once sequentially
+  leveldb::ReadOptions read_options;
+  read_options.fill_cache = false;
+  // encoded frames are decoded on --threads threads
+  std::unique_ptr<DatumReader> input_reader(new DatumReader(input_db, FLAGS_threads));
+  auto target_it = target_db->NewIterator(read_options);
+
+  FrameStoreWriter writer(argv[3], shape[0], shape[1], shape[2], float_data_size);
+  caffe::Datum input_datum, target_datum;
+  std::string key;
+  unsigned int info_iter = 5000;
+  for(target_it->SeekToFirst(); input_reader->next(&key, &input_datum); target_it->Next()) {
+    CHECK(target_it->Valid() && target_it->key() == key) << "Missing target for key " << key;
+    if(writer.count() % info_iter == 0) {
+      std::cout << "Processed " << writer.count() << " entries." << std::endl;
+    }
+    target_datum.ParseFromString(target_it->value().ToString());
+    CHECK(target_datum.float_data_size() == (int)float_data_size) << "Inconsistent float_data_size for key " << target_it->key().ToString();
+    writer.add(input_datum.data(), target_datum.float_data().data());
+  }
+  CHECK(!target_it->Valid()) << "Missing input for key " << target_it->key().ToString();
+  CHECK(target_it->status().ok()) << target_it->status().ToString();
+  delete target_it;
+  input_reader.reset();
+  delete input_db;
+  delete target_db;
+
+  writer.close();
+  std::cout << "Converted a total of " << writer.count() << " entries into " << argv[3] << "." << std::endl;
+
+  return 0;
+}
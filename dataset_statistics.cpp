@@ -0,0 +1,219 @@
+#include "utils.h"
+#include "datum_codec.h"
+
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <mutex>
+
+DEFINE_int32(threads, 0, "Number of threads scanning the dbs. 0 to use the number of cores.");
+DEFINE_int32(shards_per_thread, 4, "Number of key ranges per thread the dbs are split into for load balancing.");
+DEFINE_int32(histogram_bins, 20, "Number of bins of the histograms of the float fields of target_db.");
+
+
+// Sums over the entries of a shard, added up over all shards afterwards.
+struct Accumulator {
+  Accumulator(unsigned int image_size, unsigned int float_data_size)
+    : count(0), image_sum(image_size, 0),
+      mins(float_data_size, std::numeric_limits<float>::max()),
+      maxs(float_data_size, std::numeric_limits<float>::lowest()),
+      sums(float_data_size, 0), squared_sums(float_data_size, 0) {}
+
+  void add_image(const caffe::Datum& datum) {
+    const std::string& data = datum.data();
+    if(!data.empty()) {
+      CHECK(data.size() == image_sum.size()) << "Inconsistent image size.";
+      for(unsigned int i = 0; i < image_sum.size(); ++i) {
+        image_sum[i] += (uint8_t)data[i];
+      }
+    } else {
+      CHECK(datum.float_data_size() == (int)image_sum.size()) << "Inconsistent image size.";
+      for(unsigned int i = 0; i < image_sum.size(); ++i) {
+        image_sum[i] += datum.float_data(i);
+      }
+    }
+  }
+
+  void add_targets(const caffe::Datum& datum) {
+    for(unsigned int i = 0; i < sums.size(); ++i) {
+      float x = datum.float_data(i);
+      mins[i] = std::min(mins[i], x);
+      maxs[i] = std::max(maxs[i], x);
+      sums[i] += x;
+      squared_sums[i] += (double)x * x;
+      targets.push_back(x);
+    }
+    count += 1;
+  }
+
+  void add(const Accumulator& other) {
+    count += other.count;
+    for(unsigned int i = 0; i < image_sum.size(); ++i) {
+      image_sum[i] += other.image_sum[i];
+    }
+    for(unsigned int i = 0; i < sums.size(); ++i) {
+      mins[i] = std::min(mins[i], other.mins[i]);
+      maxs[i] = std::max(maxs[i], other.maxs[i]);
+      sums[i] += other.sums[i];
+      squared_sums[i] += other.squared_sums[i];
+    }
+    targets.insert(targets.end(), other.targets.begin(), other.targets.end());
+  }
+
+  size_t count;
+  std::vector<double> image_sum;
+  std::vector<float> mins, maxs;
+  std::vector<double> sums, squared_sums;
+  // the float fields of all entries row by row, kept for the histograms
+  // since their range is only known after the scan
+  std::vector<float> targets;
+};
+
+
+// Compute the statistics of a dataset in a single scan over its input and
+// target db: the mean image as written by caffe's compute_image_mean, the
+// linear normalization of the targets to [a, b] as written by normalize.cpp
+// and mean, standard deviation and a histogram of every target field. Both
+// dbs are split into the same key ranges that are scanned by --threads
+// threads in lockstep.
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Compute mean image and normalization of a dataset in a single scan.\n"
+                          "Usage: dataset_statistics [FLAGS] a b input_db target_db mean_blob normalization_blob");
+
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if(argc != 7) {
+    LOG(ERROR) << "Usage: " << argv[0] << " a b input_db target_db mean_blob normalization_blob";
+    return 1;
+  }
+
+  // interval to normalize to
+  float a = atof(argv[1]),
+        b = atof(argv[2]);
+  CHECK(a < b) << "Invalid interval: [" << a << ", " << b << "]";
+  CHECK(FLAGS_histogram_bins > 0) << "--histogram_bins must be positive.";
+
+  // open dbs
+  leveldb::Options options;
+  options.error_if_exists = false;
+  options.create_if_missing = false;
+  options.max_open_files = 100;
+  auto input_db = open_leveldb(argv[3], options);
+  auto target_db = open_leveldb(argv[4], options);
+  auto shape = infer_shape(input_db);
+  auto float_data_size = infer_float_data_size(target_db);
+  const unsigned int image_size = shape[0] * shape[1] * shape[2];
+  std::cout << "Inferred shape: " << shape[0] << " " << shape[1] << " " << shape[2] << std::endl;
+  std::cout << "Inferred float_data_size: " << float_data_size << std::endl;
+  CHECK(image_size > 0) << "Can not compute the mean of images without size.";
+  CHECK(float_data_size > 0) << "Can not normalize dataset which contains no float data.";
+
+  const int n_threads = FLAGS_threads > 0 ? FLAGS_threads : std::max(1u, std::thread::hardware_concurrency());
+  const auto shards = shard_key_range(input_db, n_threads * std::max(1, FLAGS_shards_per_thread));
+  // the dbs are scanned once
+  leveldb::ReadOptions read_options;
+  read_options.fill_cache = false;
+
+  Accumulator total(image_size, float_data_size);
+  std::mutex mutex;
+  std::atomic<unsigned int> count(0);
+  for_each_shard(shards, n_threads, [&](const KeyRange& shard) {
+    Accumulator accumulator(image_size, float_data_size);
+    caffe::Datum datum;
+    auto input_it = input_db->NewIterator(read_options);
+    auto target_it = target_db->NewIterator(read_options);
+    input_it->Seek(shard.begin);
+    target_it->Seek(shard.begin);
+    for(; input_it->Valid() && shard.contains(input_it->key()); input_it->Next(), target_it->Next()) {
+      CHECK(target_it->Valid() && target_it->key() == input_it->key()) << "Missing target for key " << input_it->key().ToString();
+      datum.ParseFromString(input_it->value().ToString());
+      decode_datum(&datum);
+      accumulator.add_image(datum);
+      datum.ParseFromString(target_it->value().ToString());
+      CHECK(datum.float_data_size() == (int)float_data_size) << "Inconsistent float_data_size for key " << target_it->key().ToString();
+      accumulator.add_targets(datum);
+      count_processed(count);
+    }
+    CHECK(!(target_it->Valid() && shard.contains(target_it->key()))) << "Missing input for key " << target_it->key().ToString();
+    CHECK(input_it->status().ok()) << input_it->status().ToString();
+    CHECK(target_it->status().ok()) << target_it->status().ToString();
+    delete input_it;
+    delete target_it;
+    std::lock_guard<std::mutex> lock(mutex);
+    total.add(accumulator);
+  });
+  delete input_db;
+  delete target_db;
+  std::cout << "Looked at a total of " << total.count << " keys." << std::endl;
+  CHECK(total.count > 0) << "Empty dataset.";
+
+  // write mean image as BlobProto of shape (1, channels, height, width)
+  caffe::BlobProto mean_blob;
+  mean_blob.set_num(1);
+  mean_blob.set_channels(shape[0]);
+  mean_blob.set_height(shape[1]);
+  mean_blob.set_width(shape[2]);
+  for(unsigned int i = 0; i < image_size; ++i) {
+    mean_blob.add_data(total.image_sum[i] / total.count);
+  }
+  LOG(INFO) << "Writing mean image to " << argv[5];
+  caffe::WriteProtoToBinaryFile(mean_blob, argv[5]);
+  const unsigned int plane = shape[1] * shape[2];
+  for(unsigned int c = 0; c < shape[0]; ++c) {
+    double channel_sum = 0;
+    for(unsigned int i = 0; i < plane; ++i) {
+      channel_sum += mean_blob.data(c * plane + i);
+    }
+    std::cout << "Mean of channel " << c << ": " << channel_sum / plane << std::endl;
+  }
+
+  // write slope and bias for each field as BlobProto, see normalize.cpp
+  caffe::BlobProto normalization_parameters_blob;
+  caffe::BlobShape* blob_shape = normalization_parameters_blob.mutable_shape();
+  blob_shape->add_dim(float_data_size);
+  blob_shape->add_dim(2);
+  for(unsigned int i = 0; i < float_data_size; ++i) {
+    normalization_parameters_blob.add_data((b - a)/(total.maxs[i] - total.mins[i]));
+    normalization_parameters_blob.add_data(a - (b - a)/(total.maxs[i] - total.mins[i])*total.mins[i]);
+  }
+  LOG(INFO) << "Writing normalization blob to " << argv[6];
+  caffe::WriteProtoToBinaryFile(normalization_parameters_blob, argv[6]);
+
+  // histograms of the float fields over [min, max]
+  const int bins = FLAGS_histogram_bins;
+  std::vector<std::vector<size_t>> histograms(float_data_size, std::vector<size_t>(bins, 0));
+  for(size_t row = 0; row < total.count; ++row) {
+    for(unsigned int i = 0; i < float_data_size; ++i) {
+      float range = total.maxs[i] - total.mins[i];
+      int bin = range > 0 ? (int)((total.targets[row * float_data_size + i] - total.mins[i]) / range * bins) : 0;
+      histograms[i][std::min(bin, bins - 1)] += 1;
+    }
+  }
+
+  // print statistics of float fields
+  std::cout << std::fixed;
+  std::cout.precision(6);
+  std::cout << "// Statistics of float_data fields:" << std::endl;
+  std::cout << std::setw(6) << "field" << std::setw(14) << "min" << std::setw(14) << "max"
+            << std::setw(14) << "mean" << std::setw(14) << "std" << std::endl;
+  for(unsigned int i = 0; i < float_data_size; ++i) {
+    double mean = total.sums[i] / total.count;
+    double variance = std::max(0., total.squared_sums[i] / total.count - mean * mean);
+    std::cout << std::setw(6) << i << std::setw(14) << total.mins[i] << std::setw(14) << total.maxs[i]
+              << std::setw(14) << mean << std::setw(14) << std::sqrt(variance) << std::endl;
+  }
+  std::cout << "// Histograms of float_data fields with " << bins << " bins from min to max:" << std::endl;
+  for(unsigned int i = 0; i < float_data_size; ++i) {
+    std::cout << std::setw(6) << i;
+    for(int bin = 0; bin < bins; ++bin) {
+      std::cout << std::setw(8) << histograms[i][bin];
+    }
+    std::cout << std::endl;
+  }
+
+  return 0;
+}
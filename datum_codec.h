@@ -0,0 +1,216 @@
+#pragma once
+
+#include "utils.h"
+#include "bounded_queue.h"
+
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+// Image format frames are encoded with in the data of a caffe::Datum,
+// marked by its encoded field. format is "png" or "jpg", or empty to store
+// raw frames. quality is the JPEG quality (0 to 100) or the PNG compression
+// level (0 to 9), -1 for the default of the format.
+struct FrameEncoding {
+  explicit FrameEncoding(const std::string& format = "", int quality = -1) : format(format) {
+    CHECK(format.empty() || format == "png" || format == "jpg") << "Unknown frame encoding: " << format;
+    if(format == "png") {
+      params = {cv::IMWRITE_PNG_COMPRESSION, quality >= 0 ? quality : 3};
+    } else if(format == "jpg") {
+      params = {cv::IMWRITE_JPEG_QUALITY, quality >= 0 ? quality : 95};
+    }
+  }
+
+  bool enabled() const { return !format.empty(); }
+
+  std::string format;
+  std::vector<int> params;
+};
+
+
+// Encode an image in interleaved (height, width, channel) layout into the
+// data of datum. The shape of the datum is kept such that it can be known
+// without decoding.
+inline void encode_frame(const FrameEncoding& encoding, const uint8_t* image, int channels, int height, int width, caffe::Datum* datum)
+{
+  CHECK(encoding.enabled()) << "No encoding given.";
+  cv::Mat mat(height, width, CV_8UC(channels), (void*)image);
+  std::vector<uchar> buffer;
+  CHECK(cv::imencode("." + encoding.format, mat, buffer, encoding.params)) << "Could not encode frame as " << encoding.format;
+  datum->set_data(buffer.data(), buffer.size());
+  datum->set_encoded(true);
+  datum->set_channels(channels);
+  datum->set_height(height);
+  datum->set_width(width);
+}
+
+// Encode the raw image of datum in place.
+inline void encode_datum(const FrameEncoding& encoding, caffe::Datum* datum)
+{
+  CHECK(!datum->encoded()) << "Datum is encoded already.";
+  const int channels = datum->channels(), height = datum->height(), width = datum->width();
+  const std::string& data = datum->data();
+  CHECK(data.size() == (size_t)channels * height * width) << "Datum has no raw image of its shape.";
+  // planar to interleaved layout
+  std::vector<uint8_t> image(data.size());
+  for(int c = 0; c < channels; ++c) {
+    for(int h = 0; h < height; ++h) {
+      for(int w = 0; w < width; ++w) {
+        image[(h * width + w) * channels + c] = (uint8_t)data[(c * height + h) * width + w];
+      }
+    }
+  }
+  encode_frame(encoding, image.data(), channels, height, width, datum);
+}
+
+// Decode the image of datum in place into its raw (channel, height, width)
+// layout, datums that are not encoded are left untouched.
+inline void decode_datum(caffe::Datum* datum)
+{
+  if(!datum->encoded()) return;
+  const std::string& data = datum->data();
+  cv::Mat buffer(1, data.size(), CV_8UC1, (void*)data.data());
+  cv::Mat image = cv::imdecode(buffer, datum->channels() == 1 ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR);
+  CHECK(image.data != nullptr) << "Could not decode datum.";
+  const int channels = image.channels(), height = image.rows, width = image.cols;
+  std::string raw(channels * height * width, 0);
+  for(int h = 0; h < height; ++h) {
+    const uint8_t* row = image.ptr<uint8_t>(h);
+    for(int w = 0; w < width; ++w) {
+      for(int c = 0; c < channels; ++c) {
+        raw[(c * height + h) * width + w] = (char)row[w * channels + c];
+      }
+    }
+  }
+  datum->set_data(raw);
+  datum->set_encoded(false);
+  datum->set_channels(channels);
+  datum->set_height(height);
+  datum->set_width(width);
+}
+
+
+// Read the datums of a leveldb in the order of their keys and decode them
+// on n_threads threads (0 for the number of cores). A reader thread hands
+// chunks of chunk_size entries to the decoding threads and at most
+// queue_size chunks are read ahead.
+class DatumReader {
+  public:
+    DatumReader(leveldb::DB* db, int n_threads = 0, const std::string& start_key = "", int chunk_size = 16, int queue_size = 8)
+      : db(db), n_threads(n_threads > 0 ? n_threads : std::max(1u, std::thread::hardware_concurrency())),
+        chunk_size(chunk_size), queue_size(queue_size), position(0)
+    {
+      seek(start_key);
+    }
+
+    ~DatumReader() {
+      stop();
+    }
+
+    // continue with the first key that is not less than key
+    void seek(const std::string& key) {
+      stop();
+      chunk.clear();
+      position = 0;
+      chunks.reset(new BoundedQueue<std::future<Chunk>>(queue_size));
+      work.reset(new BoundedQueue<Work>(queue_size));
+      reader = std::thread(&DatumReader::read, this, key);
+      for(int i = 0; i < n_threads; ++i) {
+        decoders.emplace_back(&DatumReader::decode, this);
+      }
+    }
+
+    // returns false after the last entry, value is set to the datum as it
+    // is stored if given
+    bool next(std::string* key, caffe::Datum* datum, std::string* value = nullptr) {
+      while(position >= chunk.size()) {
+        std::future<Chunk> next_chunk;
+        if(!chunks->pop(&next_chunk)) return false;
+        chunk = next_chunk.get();
+        position = 0;
+      }
+      Entry& entry = chunk[position++];
+      key->swap(entry.key);
+      datum->Swap(&entry.datum);
+      if(value != nullptr) value->swap(entry.value);
+      return true;
+    }
+
+  protected:
+    struct Entry {
+      std::string key;
+      std::string value;
+      caffe::Datum datum;
+    };
+    typedef std::vector<Entry> Chunk;
+    // serialized entries to decode into the chunk of result
+    struct Work {
+      std::vector<std::pair<std::string, std::string>> entries;
+      std::promise<Chunk> result;
+    };
+
+    void read(std::string start_key) {
+      leveldb::ReadOptions read_options;
+      read_options.fill_cache = false;
+      auto it = db->NewIterator(read_options);
+      Work item;
+      bool stopped = false;
+      for(it->Seek(start_key); it->Valid() && !stopped; it->Next()) {
+        item.entries.emplace_back(it->key().ToString(), it->value().ToString());
+        if((int)item.entries.size() >= chunk_size) {
+          stopped = !hand_out(std::move(item));
+          item = Work();
+        }
+      }
+      if(!stopped && !item.entries.empty()) hand_out(std::move(item));
+      CHECK(it->status().ok()) << it->status().ToString();
+      delete it;
+      chunks->close();
+      work->close();
+    }
+
+    // returns false if the reader was stopped
+    bool hand_out(Work item) {
+      if(!chunks->push(item.result.get_future())) return false;
+      return work->push(std::move(item));
+    }
+
+    void decode() {
+      Work item;
+      while(work->pop(&item)) {
+        Chunk decoded(item.entries.size());
+        for(size_t i = 0; i < item.entries.size(); ++i) {
+          decoded[i].key = std::move(item.entries[i].first);
+          decoded[i].value = std::move(item.entries[i].second);
+          decoded[i].datum.ParseFromString(decoded[i].value);
+          decode_datum(&decoded[i].datum);
+        }
+        item.result.set_value(std::move(decoded));
+      }
+    }
+
+    void stop() {
+      if(!reader.joinable()) return;
+      chunks->close();
+      work->close();
+      reader.join();
+      for(auto& decoder : decoders) {
+        decoder.join();
+      }
+      decoders.clear();
+    }
+
+    leveldb::DB* db;
+    int n_threads, chunk_size, queue_size;
+    std::unique_ptr<BoundedQueue<std::future<Chunk>>> chunks;
+    std::unique_ptr<BoundedQueue<Work>> work;
+    std::thread reader;
+    std::vector<std::thread> decoders;
+    // chunk handed out by next
+    Chunk chunk;
+    size_t position;
+};
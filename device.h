@@ -0,0 +1,273 @@
+#pragma once
+
+#include <glog/logging.h>
+
+#include <caffe/caffe.hpp>
+
+#ifndef CPU_ONLY
+#include <cuda_runtime.h>
+#endif
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#include <alloca.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+// Thread control of the BLAS and OpenMP runtimes caffe might be linked
+// against. Declared weak such that only those present in the process are
+// called.
+extern "C" {
+void openblas_set_num_threads(int) __attribute__((weak));
+void MKL_Set_Num_Threads(int) __attribute__((weak));
+void omp_set_num_threads(int) __attribute__((weak));
+}
+
+
+// Select the device caffe runs on in the calling thread. device is one of
+// "cpu", "gpu" (best GPU), "gpu:N" (GPU with index N) or "auto" (best GPU
+// if there is one, CPU otherwise). The best GPU is the one with the most
+// multiprocessors. Returns the selected mode.
+inline caffe::Caffe::Brew select_device(const std::string& device)
+{
+  const bool want_gpu = device.compare(0, 3, "gpu") == 0;
+  CHECK(device == "auto" || device == "cpu" || want_gpu) << "Unknown device: " << device;
+  if(device == "cpu") {
+    LOG(INFO) << "Using CPU.";
+    caffe::Caffe::set_mode(caffe::Caffe::CPU);
+    return caffe::Caffe::CPU;
+  }
+
+#ifdef CPU_ONLY
+  CHECK(!want_gpu) << "caffe was built without GPU support, can not use device " << device;
+  LOG(INFO) << "caffe was built without GPU support. Using CPU.";
+  caffe::Caffe::set_mode(caffe::Caffe::CPU);
+  return caffe::Caffe::CPU;
+#else
+  int n_gpus = 0;
+  if(cudaGetDeviceCount(&n_gpus) != cudaSuccess) n_gpus = 0;
+  if(n_gpus == 0) {
+    CHECK(!want_gpu) << "No GPU found, can not use device " << device;
+    LOG(INFO) << "No GPU found. Using CPU.";
+    caffe::Caffe::set_mode(caffe::Caffe::CPU);
+    return caffe::Caffe::CPU;
+  }
+
+  int gpu_idx = 0;
+  if(device.size() > 4 && device[3] == ':') {
+    gpu_idx = std::stoi(device.substr(4));
+    CHECK(0 <= gpu_idx && gpu_idx < n_gpus) << "Invalid GPU index " << gpu_idx << ", found " << n_gpus << " GPUs.";
+  } else {
+    int best_multiprocessors = -1;
+    for(int i = 0; i < n_gpus; ++i) {
+      cudaDeviceProp properties;
+      if(cudaGetDeviceProperties(&properties, i) != cudaSuccess) continue;
+      if(properties.multiProcessorCount > best_multiprocessors) {
+        best_multiprocessors = properties.multiProcessorCount;
+        gpu_idx = i;
+      }
+    }
+  }
+  LOG(INFO) << "Using GPU " << gpu_idx << ".";
+  caffe::Caffe::SetDevice(gpu_idx);
+  caffe::Caffe::DeviceQuery();
+  caffe::Caffe::set_mode(caffe::Caffe::GPU);
+  return caffe::Caffe::GPU;
+#endif
+}
+
+
+// GPU caffe runs on in the calling thread, -1 for the CPU.
+inline int current_gpu()
+{
+  if(caffe::Caffe::mode() == caffe::Caffe::CPU) return -1;
+#ifdef CPU_ONLY
+  return -1;
+#else
+  int gpu_idx = 0;
+  CHECK(cudaGetDevice(&gpu_idx) == cudaSuccess) << "Can not query current GPU.";
+  return gpu_idx;
+#endif
+}
+
+
+// Run caffe on the given GPU (-1 for the CPU) in the calling thread. caffe
+// keeps its mode per thread, so threads other than the one that called
+// select_device have to use this with the result of current_gpu().
+inline void use_gpu(int gpu_idx)
+{
+  if(gpu_idx < 0) {
+    caffe::Caffe::set_mode(caffe::Caffe::CPU);
+    return;
+  }
+  caffe::Caffe::SetDevice(gpu_idx);
+  caffe::Caffe::set_mode(caffe::Caffe::GPU);
+}
+
+
+// Set the number of threads used by BLAS and OpenMP. n_threads <= 0 keeps
+// the defaults of the libraries.
+inline void set_compute_threads(int n_threads)
+{
+  if(n_threads <= 0) return;
+  bool found = false;
+  if(openblas_set_num_threads != nullptr) {
+    openblas_set_num_threads(n_threads);
+    found = true;
+  }
+  if(MKL_Set_Num_Threads != nullptr) {
+    MKL_Set_Num_Threads(n_threads);
+    found = true;
+  }
+  if(omp_set_num_threads != nullptr) {
+    omp_set_num_threads(n_threads);
+    found = true;
+  }
+  if(found) {
+    LOG(INFO) << "Using " << n_threads << " compute threads.";
+  } else {
+    LOG(WARNING) << "No BLAS or OpenMP runtime with configurable thread count found.";
+  }
+}
+
+
+// parse a list of cores like "0-3,6" into a cpu set
+inline cpu_set_t parse_cpu_list(const std::string& cpus)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  std::stringstream ss(cpus);
+  std::string item;
+  while(std::getline(ss, item, ',')) {
+    if(item.empty()) continue;
+    auto dash = item.find('-');
+    int first = std::stoi(item.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+    CHECK(0 <= first && first <= last && last < CPU_SETSIZE) << "Invalid core range: " << item;
+    for(int cpu = first; cpu <= last; ++cpu) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  CHECK(CPU_COUNT(&set) > 0) << "Empty core list: " << cpus;
+  return set;
+}
+
+
+// Restrict all threads of the process to the cores in cpus (see
+// parse_cpu_list). Threads created later, e.g. by BLAS, inherit the
+// affinity of their creator. An empty list keeps the current affinity.
+inline void set_cpu_affinity(const std::string& cpus)
+{
+  if(cpus.empty()) return;
+  cpu_set_t set = parse_cpu_list(cpus);
+  DIR* tasks = opendir("/proc/self/task");
+  CHECK(tasks != nullptr) << "Can not list threads of process.";
+  unsigned int n_threads = 0;
+  while(struct dirent* entry = readdir(tasks)) {
+    if(entry->d_name[0] == '.') continue;
+    pid_t tid = atoi(entry->d_name);
+    CHECK(sched_setaffinity(tid, sizeof(set), &set) == 0) << "sched_setaffinity() unsuccessful for thread " << tid << ".";
+    n_threads += 1;
+  }
+  closedir(tasks);
+  LOG(INFO) << "Pinned " << n_threads << " threads to cores " << cpus << ".";
+}
+
+
+// Restrict the calling thread to the cores in cpus (see parse_cpu_list).
+inline void pin_current_thread(const std::string& cpus)
+{
+  cpu_set_t set = parse_cpu_list(cpus);
+  CHECK(sched_setaffinity(0, sizeof(set), &set) == 0) << "sched_setaffinity() unsuccessful: " << strerror(errno);
+  LOG(INFO) << "Pinned control thread to cores " << cpus << ".";
+}
+
+
+// Run all threads of the process with the real-time policy SCHED_FIFO at
+// priority (1 to 99), threads created later inherit it. Fails if the
+// process lacks CAP_SYS_NICE and its rtprio limit is below priority.
+inline void set_realtime_priority(int priority)
+{
+  CHECK(sched_get_priority_min(SCHED_FIFO) <= priority && priority <= sched_get_priority_max(SCHED_FIFO)) <<
+    "Invalid SCHED_FIFO priority " << priority << ".";
+  struct sched_param param;
+  param.sched_priority = priority;
+  DIR* tasks = opendir("/proc/self/task");
+  CHECK(tasks != nullptr) << "Can not list threads of process.";
+  unsigned int n_threads = 0;
+  while(struct dirent* entry = readdir(tasks)) {
+    if(entry->d_name[0] == '.') continue;
+    pid_t tid = atoi(entry->d_name);
+    if(sched_setscheduler(tid, SCHED_FIFO, &param) != 0) {
+      LOG(FATAL) << "sched_setscheduler(SCHED_FIFO, " << priority << ") unsuccessful for thread " << tid << ": "
+        << strerror(errno) << ". Real-time scheduling requires CAP_SYS_NICE or an rtprio limit of at least "
+        << priority << ", e.g. in /etc/security/limits.conf.";
+    }
+    n_threads += 1;
+  }
+  closedir(tasks);
+  LOG(INFO) << "Running " << n_threads << " threads with SCHED_FIFO priority " << priority << ".";
+}
+
+
+// Return the calling thread to normal scheduling, e.g. for background work
+// in a process that runs with set_realtime_priority. Returns false and
+// warns if the policy could not be changed.
+inline bool set_normal_priority()
+{
+  struct sched_param param;
+  param.sched_priority = 0;
+  if(sched_setscheduler(0, SCHED_OTHER, &param) != 0) {
+    LOG(WARNING) << "sched_setscheduler(SCHED_OTHER) unsuccessful: " << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+
+// Lock all current and future pages of the process into RAM, such that
+// weights, blobs and attached shared memory never page fault once they were
+// touched. The stack of the calling thread is faulted in up front. Fails if
+// the process lacks CAP_IPC_LOCK and its memlock limit is too small.
+inline void lock_memory(size_t stack_size = 1 << 20)
+{
+  if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    LOG(FATAL) << "mlockall() unsuccessful: " << strerror(errno) << ". Locking memory requires CAP_IPC_LOCK or a "
+      << "memlock limit (ulimit -l) larger than the process, e.g. in /etc/security/limits.conf.";
+  }
+  volatile char* stack = (volatile char*)alloca(stack_size);
+  for(size_t i = 0; i < stack_size; i += 4096) {
+    stack[i] = 0;
+  }
+  LOG(INFO) << "Locked memory of process.";
+}
+
+
+// Count events and log their rate every interval seconds.
+class RateCounter {
+  public:
+    RateCounter(const std::string& name, double interval)
+      : name(name), interval(interval), count(0), start(std::chrono::steady_clock::now()) {}
+
+    void tick() {
+      count += 1;
+      auto now = std::chrono::steady_clock::now();
+      double elapsed = std::chrono::duration<double>(now - start).count();
+      if(interval > 0 && elapsed >= interval) {
+        LOG(INFO) << name << ": " << count / elapsed << " per second.";
+        count = 0;
+        start = now;
+      }
+    }
+
+  protected:
+    std::string name;
+    double interval;
+    unsigned int count;
+    std::chrono::steady_clock::time_point start;
+};
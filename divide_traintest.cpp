@@ -1,10 +1,15 @@
 #include "utils.h"
+#include "manifest.h"
+
+#include <gflags/gflags.h>
 
 #include <iostream>
 #include <sstream>
 #include <iomanip>
 #include <cmath>
 
+DEFINE_int32(folds, 0, "Number of folds for k-fold cross validation. 0 to divide into one train and test set of train_size entries.");
+
 void check_same_state(const std::vector<leveldb::Iterator*>& its) {
   for(unsigned int i = 1; i < its.size(); ++i) {
     CHECK(its[0]->Valid() == its[i]->Valid()) << "Inconsistent state of Iterators!";
@@ -12,21 +17,42 @@ void check_same_state(const std::vector<leveldb::Iterator*>& its) {
 }
 
 
+// An output db receiving entries under consecutive keys.
+struct Output {
+  std::string dbname;
+  leveldb::DB* db;
+  DatasetManifest manifest;
+};
+
+
 // Divide dataset into trainset consisting of train_size datums and testset
-// consisting of the remaining entries
+// consisting of the remaining entries. With --folds=K, divide it into K
+// blocks of consecutive entries instead and write for every block a testset
+// consisting of the block and a trainset consisting of all other blocks.
+// The number of entries is taken from the manifest of the first db, such
+// that all outputs are written in a single pass over the dbs.
 int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Divide databases with the same keys into train and test sets.\n"
+                          "Usage: divide_traintest [FLAGS] train_size db1 [db2 ...]\n"
+                          "       divide_traintest --folds=K [FLAGS] db1 [db2 ...]");
+
   google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
 
-  if(argc < 3) {
+  const int n_folds = FLAGS_folds;
+  const int first_db = n_folds > 0 ? 1 : 2;
+  if(argc <= first_db) {
     LOG(ERROR) << "Usage: " << argv[0] << " train_size db1 [db2 ...]";
+    LOG(ERROR) << "       " << argv[0] << " --folds=K db1 [db2 ...]";
     return 1;
   }
+  CHECK(n_folds != 1) << "Need at least two folds.";
 
-  unsigned int train_size = atoi(argv[1]);
-  int n_dbs = argc - 2;
+  unsigned int train_size = n_folds > 0 ? 0 : atoi(argv[1]);
+  int n_dbs = argc - first_db;
   std::vector<std::string> dbnames(n_dbs);
   for(int i = 0; i < n_dbs; ++i) {
-    dbnames[i] = argv[i + 2];
+    dbnames[i] = argv[i + first_db];
   }
   unsigned int info_iter = 5000; // frequency of status reports
 
@@ -35,45 +61,26 @@ int main(int argc, char** argv) {
   options.error_if_exists = false;
   options.create_if_missing = false;
   options.max_open_files = 100;
+  // the dbs are read once sequentially
+  leveldb::ReadOptions read_options;
+  read_options.fill_cache = false;
   std::vector<leveldb::DB*> dbs(dbnames.size());
   std::vector<leveldb::Iterator*> its(dbnames.size());
+  std::vector<DatasetManifest> manifests(dbnames.size());
   for(int i = 0; i < dbs.size(); ++i) {
     dbs[i] = open_leveldb(dbnames[i], options);
-    its[i] = dbs[i]->NewIterator(leveldb::ReadOptions());
+    manifests[i] = dataset_manifest(dbnames[i], dbs[i], i == 0);
+    its[i] = dbs[i]->NewIterator(read_options);
     its[i]->SeekToFirst();
   }
-
-  // count and make sure dbs have the same keys
-  unsigned int count = 0;
-  while(its[0]->Valid()) {
-    check_same_state(its);
-
-    // store key
-    auto key_0 = its[0]->key().ToString();
-    // make sure dbs are synchronized
-    for(unsigned int i = 1; i < n_dbs; ++i) {
-      auto key_i = its[i]->key().ToString();
-      CHECK(key_0 == key_i) << "Differing keys: " << key_0 << " != " << key_i;
-    }
-
-    // advance all iterators
-    for(unsigned int i = 0; i < n_dbs; ++i) {
-      its[i]->Next();
-    }
-    count += 1;
-  }
-  check_same_state(its);
-
+  const uint64_t count = manifests[0].count;
   std::cout << "Input dbs size: " << count << std::endl;
-  CHECK_LT(train_size, count) << ": Keeping dataset as it is.";
-
-  // now divide
-  std::vector<std::string> dbnames_train(n_dbs);
-  std::vector<std::string> dbnames_test(n_dbs);
-  for(unsigned int i = 0; i < n_dbs; ++i) {
-    dbnames_train[i] = dbnames[i] + "_train";
-    dbnames_test[i] = dbnames[i] + "_test";
+  if(n_folds > 0) {
+    CHECK_LE(n_folds, count) << ": Not enough entries for the folds.";
+  } else {
+    CHECK_LT(train_size, count) << ": Keeping dataset as it is.";
   }
+
   // prepare output dbs
   leveldb::Options output_options;
   output_options.error_if_exists = true;
@@ -81,48 +88,87 @@ int main(int argc, char** argv) {
   output_options.max_open_files = 100;
   leveldb::WriteOptions write_options;
 
-  // open output dbs
-  std::vector<leveldb::DB*> dbs_train(dbnames.size());
-  std::vector<leveldb::DB*> dbs_test(dbnames.size());
-  for(int i = 0; i < dbs.size(); ++i) {
-    dbs_train[i] = open_leveldb(dbnames_train[i], output_options);
-    dbs_test[i] = open_leveldb(dbnames_test[i], output_options);
+  // outputs[set][i] is the output of db i for set, where the sets are train
+  // and test or the train and test set of every fold
+  std::vector<std::vector<Output>> outputs;
+  auto add_set = [&](const std::string& suffix, const std::string& step) {
+    outputs.emplace_back(n_dbs);
+    for(int i = 0; i < n_dbs; ++i) {
+      Output& output = outputs.back()[i];
+      output.dbname = dbnames[i] + suffix;
+      output.db = open_leveldb(output.dbname, output_options);
+      output.manifest = manifests[i];
+      output.manifest.count = 0;
+      output.manifest.key_width = key_from_int(0).size();
+      output.manifest.add_step(step);
+    }
+  };
+  if(n_folds > 0) {
+    for(int fold = 0; fold < n_folds; ++fold) {
+      std::string name = "fold" + std::to_string(fold);
+      std::string of = std::to_string(fold) + " of " + std::to_string(n_folds);
+      add_set("_" + name + "_train", "divide_traintest train set of fold " + of);
+      add_set("_" + name + "_test", "divide_traintest test set of fold " + of);
+    }
+  } else {
+    add_set("_train", "divide_traintest train set of " + std::to_string(train_size));
+    add_set("_test", "divide_traintest test set after " + std::to_string(train_size));
   }
 
-  for(unsigned int i = 0; i < dbs.size(); ++i) {
-    its[i]->SeekToFirst();
-  }
-  // write train set
-  for(unsigned int s = 0; s < train_size; ++s) {
-    if(s % info_iter == 0) std::cout << "Processed " << s << " entries." << std::endl;
-    for(unsigned int i = 0; i < dbs.size(); ++i) {
-      auto status = dbs_train[i]->Put(write_options, key_from_int(s), its[i]->value());
+  // write entry s to the sets it belongs to, make sure dbs have the same keys
+  auto write = [&](unsigned int set) {
+    for(unsigned int i = 0; i < n_dbs; ++i) {
+      Output& output = outputs[set][i];
+      auto status = output.db->Put(write_options, key_from_int(output.manifest.count), its[i]->value());
       CHECK(status.ok()) << status.ToString();
-      its[i]->Next();
+      output.manifest.count += 1;
     }
-  }
-  std::cout << "Wrote " << train_size << " datums into train sets ";
-  for(unsigned int i = 0; i < dbs.size(); ++i) {
-    std::cout << dbnames_train[i];
-    if(i + 1 < dbs.size()) std::cout << ", ";
-    else std::cout << "." << std::endl;
-  }
-
-  // write test set
-  unsigned int s = 0;
+  };
+  uint64_t s = 0;
   for(; its[0]->Valid(); ++s) {
+    check_same_state(its);
+    auto key_0 = its[0]->key().ToString();
+    for(unsigned int i = 1; i < n_dbs; ++i) {
+      auto key_i = its[i]->key().ToString();
+      CHECK(key_0 == key_i) << "Differing keys: " << key_0 << " != " << key_i;
+    }
+    CHECK_LT(s, count) << ": More entries than the manifest of " << dbnames[0] << " states.";
+
     if(s % info_iter == 0) std::cout << "Processed " << s << " entries." << std::endl;
-    for(unsigned int i = 0; i < dbs.size(); ++i) {
-      auto status = dbs_test[i]->Put(write_options, key_from_int(s), its[i]->value());
-      CHECK(status.ok()) << status.ToString();
+    if(n_folds > 0) {
+      // blocks of consecutive entries
+      int test_fold = s * n_folds / count;
+      for(int fold = 0; fold < n_folds; ++fold) {
+        write(2 * fold + (fold == test_fold ? 1 : 0));
+      }
+    } else {
+      write(s < train_size ? 0 : 1);
+    }
+
+    // advance all iterators
+    for(unsigned int i = 0; i < n_dbs; ++i) {
       its[i]->Next();
     }
   }
-  std::cout << "Wrote " << s << " datums into test sets ";
-  for(unsigned int i = 0; i < dbs.size(); ++i) {
-    std::cout << dbnames_test[i];
-    if(i + 1 < dbs.size()) std::cout << ", ";
-    else std::cout << "." << std::endl;
+  check_same_state(its);
+  CHECK_EQ(s, count) << ": Fewer entries than the manifest of " << dbnames[0] << " states.";
+  for(int i = 0; i < n_dbs; ++i) {
+    CHECK(its[i]->status().ok()) << its[i]->status().ToString();
+    delete its[i];
+    delete dbs[i];
+  }
+
+  for(auto& set : outputs) {
+    std::cout << "Wrote " << set[0].manifest.count << " datums into ";
+    for(unsigned int i = 0; i < set.size(); ++i) {
+      Output& output = set[i];
+      if(output.manifest.count > 0) output.manifest.last_key = key_from_int(output.manifest.count - 1);
+      delete output.db;
+      write_manifest(output.dbname, output.manifest);
+      std::cout << output.dbname;
+      if(i + 1 < set.size()) std::cout << ", ";
+      else std::cout << "." << std::endl;
+    }
   }
 
   return 0;
@@ -1,206 +1,513 @@
 #include "utils.h"
+#include "device.h"
+#include "preprocess.h"
+#include "torcs_shm.h"
+#include "control.h"
+#include "stats.h"
+#include "recorder.h"
+#include "quantized_net.h"
+#include "model_watcher.h"
+#include "scheduler.h"
 
 #include <caffe/data_transformer.hpp>
 
-#include <iostream>
+#include <gflags/gflags.h>
 
-#include <sys/shm.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
 
 const int ASCII_ESC = 27;
-const int n_outputs = 15;
+const int n_outputs = n_targets;
 const float scale_sc = 300; // factor to multiply steering command with
 
-const int n_channels = 3;
-// image size as captured from torcs
-const int image_width = 640;
-const int image_height = 480;
-// image size used for network input
-const int net_image_width = 280;
-const int net_image_height = 210;
-
-// struct used for shared memory communication with torcs
-struct SharedStruct
-{  
-    int written;  //a label, if 1: available to read, if 0: available to write
-    uint8_t data[image_width*image_height*3];  // image data field  
-    int control;
-    int pause;
-    double fast;
-
-    double dist_L;
-    double dist_R;
-
-    double toMarking_L;
-    double toMarking_M;
-    double toMarking_R;
-
-    double dist_LL;
-    double dist_MM;
-    double dist_RR;
-
-    double toMarking_LL;
-    double toMarking_ML;
-    double toMarking_MR;
-    double toMarking_RR;
-
-    double toMiddle;
-    double angle;
-    double speed;
-
-    double steerCmd;
-    double accelCmd;
-    double brakeCmd;
-
-    void clear() {
-      written = 0;
-      control = 0;
-      pause = 0;
-      fast = 0;
-      dist_L = 0;
-      dist_R = 0;
-      toMarking_L = 0;
-      toMarking_M = 0;
-      toMarking_R = 0;
-      dist_LL = 0;
-      dist_MM = 0;
-      dist_RR = 0;
-      toMarking_LL = 0;
-      toMarking_ML = 0;
-      toMarking_MR = 0;
-      toMarking_RR = 0;
-      toMiddle = 0;
-      angle = 0;
-      speed = 0;
-      
-      steerCmd = 0;
-      accelCmd = 0;
-      brakeCmd = 0;
+// keyboard bindings to control commands
+std::map<char, std::string> bindings{
+  {ASCII_ESC, "quit"},
+  {'q', "quit"},
+  {'p', "pause"},
+  {'w', "accelerate"},
+  {'s', "brake"},
+  {'a', "left"},
+  {'d', "right"},
+  {'+', "faster"},
+  {'-', "slower"}};
+
+DEFINE_string(device, "auto", "Device to run the network on: auto, cpu, gpu or gpu:N.");
+DEFINE_int32(threads, 0, "Number of BLAS/OpenMP threads used for inference on the CPU and of threads of int8 inference. 0 uses the library default and the number of cores for int8.");
+DEFINE_string(int8_calibration, "", "Run the layers given by --int8_layers in int8 on the CPU using this calibration as written by evaluate_quantization. Empty to run in float.");
+DEFINE_string(int8_layers, default_quantized_layers, "Comma separated names of the layers to compute in int8.");
+DEFINE_int32(watch_weights_ms, 0, "Interval in milliseconds to check input_weights for changes. Changed weights are loaded in the background and driven with once they are ready. 0 to disable.");
+DEFINE_string(cpus, "", "Cores to run on, e.g. 0-3,6. Empty to not restrict cores.");
+DEFINE_string(control_cpus, "", "Cores to run the control loop on, e.g. 2, while the other threads run on --cpus. The control loop runs the forward pass as master thread of BLAS/OpenMP. Empty to use --cpus.");
+DEFINE_bool(realtime, false, "Run with SCHED_FIFO priority --realtime_priority, lock all memory and the shared memory segments into RAM. Fails if the privileges for this are missing.");
+DEFINE_int32(realtime_priority, 50, "SCHED_FIFO priority of all threads with --realtime.");
+DEFINE_double(fps_interval, 10, "Interval in seconds to report the achieved frames per second. 0 to disable.");
+DEFINE_int32(shm_key, shm_key, "Key of the shared memory segment, torcs must use the same.");
+DEFINE_string(shm_protocol, "legacy", "Shared memory protocol: legacy (single frame, see SharedStruct) or ring (see SharedRing).");
+DEFINE_int32(ring_slots, 4, "Number of frame slots when using the ring protocol.");
+DEFINE_int32(cars, 1, "Number of cars to drive. Car i uses the shared memory segment with key shm_key + i and frames of all cars are predicted in batches.");
+DEFINE_int32(max_batch, 0, "Maximum number of frames predicted in one batch if driving several cars. 0 to use the number of cars.");
+DEFINE_int32(batch_deadline_us, 2000, "Time in microseconds to wait for frames of further cars after the first frame of a batch is ready.");
+DEFINE_int32(deadline_us, 0, "Time in microseconds from acquiring a frame to answering it. Frames whose prediction is expected to miss it are handled according to --deadline_policy. 0 to disable.");
+DEFINE_int32(deadline_max_fallbacks, 10, "Predict the frame of a car after this many consecutive frames were answered by --deadline_policy=hold or extrapolate.");
+DEFINE_string(deadline_policy, "latest", "Handling of frames that would miss --deadline_us: latest (drop them if a newer frame is available), hold (answer with the last predicted steering command) or extrapolate (answer with the steering command extrapolated from the last two predictions).");
+DEFINE_bool(pipeline, true, "Preprocess the next frame on a separate thread while the network runs on the current one.");
+DEFINE_int32(shm_poll_us, 200, "Interval in microseconds to recheck for a new frame if torcs does not wake drive_torcs.");
+DEFINE_int32(shm_spin_us, 0, "Time in microseconds to busy wait for a new frame before sleeping.");
+DEFINE_int32(control_interval_ms, 30, "Interval in milliseconds to update windows and poll keyboard and control socket.");
+DEFINE_string(control_socket, "", "Path of a Unix datagram socket to receive control commands on (quit, pause, accelerate, brake, left, right, faster, slower, speed <value>). Empty to disable.");
+DEFINE_double(stats_interval, 10, "Interval in seconds to report latencies of the stages of the control loop. 0 to disable.");
+DEFINE_string(stats_file, "", "File to write latency reports to. Empty to log them.");
+DEFINE_string(record, "", "Record preprocessed frames and targets (ground truth and steering command sent) into the leveldbs <record>_input and <record>_target. Empty to disable.");
+DEFINE_int32(record_queue, 1000, "Maximum number of frames waiting to be recorded, further frames are dropped.");
+DEFINE_int32(record_batch, 100, "Number of frames written to the recording leveldbs at once.");
+DEFINE_string(record_encode, "", "Encode recorded frames as png or jpg. Empty to record raw frames.");
+DEFINE_int32(record_encode_quality, -1, "JPEG quality (0 to 100) or PNG compression level (0 to 9) of --record_encode. -1 for the default.");
+DEFINE_bool(check_preprocessing, false, "Compare the fused preprocessing of every frame against the reference implementation using OpenCV and caffe::DataTransformer.");
+
+void init_datum(caffe::Datum& datum) {
+  datum.set_channels(n_channels);
+  datum.set_height(net_image_height);
+  datum.set_width(net_image_width);
+  datum.mutable_data()->resize(3 * net_image_height * net_image_width); 
+}
+
+// reference implementation of the preprocessing using the same method as
+// used in torcs, to be followed by caffe::DataTransformer
+void copy_img_to_datum(const uint8_t* data, caffe::Datum& datum) {
+  CHECK_EQ(datum.channels(), n_channels);
+  CHECK_EQ(datum.height(), net_image_height);
+  CHECK_EQ(datum.width(), net_image_width);
+  IplImage* input_img = cvCreateImage(cvSize(image_width, image_height), IPL_DEPTH_8U, n_channels);
+  IplImage* net_img = cvCreateImage(cvSize(net_image_width, net_image_height), IPL_DEPTH_8U, n_channels);
+  // copy input image to IplImage
+  for(int h = 0; h < image_height; ++h) {
+    for(int w = 0; w < image_width; ++w) {
+      for(int c = 0; c < n_channels; ++c) {
+        input_img->imageData[(h*image_width + w)*n_channels + c] = data[((image_height - 1 - h)*image_width + w)*n_channels + (n_channels - 1 - c)];
+      }
+    }
+  }
+  // resize
+  cvResize(input_img, net_img);
+
+  // copy resized image into datum
+  std::string* datum_data = datum.mutable_data();
+  for(int h = 0; h < net_image_height; ++h) {
+    for(int w = 0; w < net_image_width; ++w) {
+      for(int c = 0; c < n_channels; ++c) {
+        (*datum_data)[(c*net_image_height + h)*net_image_width + w] = (char)(net_img->imageData[(h*net_image_width + w)*n_channels + c]);
+      }
     }
+  }
+
+  // clean up
+  cvReleaseImage(&input_img);
+  cvReleaseImage(&net_img);
+}
+
 
-    void init_datum(caffe::Datum& datum) {
-      datum.set_channels(n_channels);
-      datum.set_height(net_image_height);
-      datum.set_width(net_image_width);
-      datum.mutable_data()->resize(3 * net_image_height * net_image_width); 
+// Network with trained weights, ready to predict batches of up to
+// batch_size frames
+struct DrivingModel {
+  std::unique_ptr<caffe::Net<float>> network;
+  std::unique_ptr<QuantizedNet> quantized_network;
+  caffe::Blob<float>* input_blob;
+  caffe::Blob<float>* output_blob;
+
+  void Forward() {
+    if(quantized_network) {
+      quantized_network->Forward();
+    } else {
+      network->Forward();
     }
-    void copy_img_to_datum(caffe::Datum& datum) {
-      CHECK_EQ(datum.channels(), n_channels);
-      CHECK_EQ(datum.height(), net_image_height);
-      CHECK_EQ(datum.width(), net_image_width);
-      // for testing we use the same method as used in torcs - then we will
-      // switch to c++ binding for opencv and compare the result
-      IplImage* input_img = cvCreateImage(cvSize(image_width, image_height), IPL_DEPTH_8U, n_channels);
-      IplImage* net_img = cvCreateImage(cvSize(net_image_width, net_image_height), IPL_DEPTH_8U, n_channels);
-      // copy input image to IplImage
-      //for(int i = 0; i < image_height * image_width * n_channels; ++i) {
-      //  input_img->imageData[i] = data[i];
-      //}
-      for(int h = 0; h < image_height; ++h) {
-        for(int w = 0; w < image_width; ++w) {
-          for(int c = 0; c < n_channels; ++c) {
-            input_img->imageData[(h*image_width + w)*n_channels + c] = data[((image_height - 1 - h)*image_width + w)*n_channels + (n_channels - 1 - c)];
-          }
-        }
+  }
+};
+
+// Check that trained_network_params holds weights of the right shapes for
+// every layer of network that has any, such that CopyTrainedLayersFrom
+// neither fails nor leaves layers untrained. Otherwise describes the first
+// mismatch in reason.
+bool weights_match(const caffe::Net<float>& network, const caffe::NetParameter& trained_network_params, std::string* reason)
+{
+  std::map<std::string, const caffe::LayerParameter*> trained_layers;
+  for(int i = 0; i < trained_network_params.layer_size(); ++i) {
+    trained_layers[trained_network_params.layer(i).name()] = &trained_network_params.layer(i);
+  }
+  for(unsigned int i = 0; i < network.layers().size(); ++i) {
+    const std::string& name = network.layer_names()[i];
+    const auto& blobs = network.layers()[i]->blobs();
+    auto trained = trained_layers.find(name);
+    if(trained == trained_layers.end()) {
+      if(blobs.empty()) continue;
+      *reason = "no weights for layer " + name;
+      return false;
+    }
+    if(trained->second->blobs_size() != (int)blobs.size()) {
+      *reason = "layer " + name + " has " + std::to_string(trained->second->blobs_size()) + " blobs instead of " +
+        std::to_string(blobs.size());
+      return false;
+    }
+    for(unsigned int j = 0; j < blobs.size(); ++j) {
+      if(!blobs[j]->ShapeEquals(trained->second->blobs(j))) {
+        *reason = "blob " + std::to_string(j) + " of layer " + name + " does not have the shape " + blobs[j]->shape_string();
+        return false;
       }
-      // resize
-      cvResize(input_img, net_img);
-      cvShowImage("Frame", net_img);
-
-      // copy resized image into datum
-      //datum.mutable_data()->resize(3 * net_image_height * net_image_width); 
-      std::string* datum_data = datum.mutable_data();
-      for(int h = 0; h < net_image_height; ++h) {
-        for(int w = 0; w < net_image_width; ++w) {
-          for(int c = 0; c < n_channels; ++c) {
-            (*datum_data)[(c*net_image_height + h)*net_image_width + w] = (char)(net_img->imageData[(h*net_image_width + w)*n_channels + c]);
-          }
-        }
+    }
+  }
+  return true;
+}
+
+// Load the weights in weights_fname into a network described by
+// network_params. Returns nullptr if the weights can not be read, e.g.
+// because the file is incomplete, or do not fit the network.
+std::unique_ptr<DrivingModel> load_model(const caffe::NetParameter& network_params, const std::string& weights_fname,
+                                         int batch_size)
+{
+  caffe::NetParameter trained_network_params;
+  if(!caffe::ReadProtoFromBinaryFile(weights_fname, &trained_network_params) ||
+     !caffe::UpgradeNetAsNeeded(weights_fname, &trained_network_params)) {
+    return nullptr;
+  }
+  std::unique_ptr<DrivingModel> model(new DrivingModel);
+  model->network.reset(new caffe::Net<float>(network_params));
+  std::string mismatch;
+  if(!weights_match(*model->network, trained_network_params, &mismatch)) {
+    LOG(ERROR) << "Weights in " << weights_fname << " do not fit the network: " << mismatch;
+    return nullptr;
+  }
+  model->network->CopyTrainedLayersFrom(trained_network_params);
+
+  // int8 inference
+  if(!FLAGS_int8_calibration.empty()) {
+    CHECK(caffe::Caffe::mode() == caffe::Caffe::CPU) << "int8 inference runs on the CPU only, use --device=cpu.";
+    model->quantized_network.reset(new QuantizedNet(*model->network, split_layer_names(FLAGS_int8_layers), FLAGS_threads));
+    model->quantized_network->load_calibration(FLAGS_int8_calibration);
+  }
+
+  // input blob
+  const std::vector<caffe::Blob<float>*>& input_blobs = model->network->input_blobs();
+  CHECK(input_blobs.size() == 1) << "Expected a single input blob.";
+  model->input_blob = input_blobs[0];
+  CHECK(model->input_blob->shape()[0] == 1) << "Input consists of a single frame.";
+  CHECK(model->input_blob->shape()[1] == n_channels) << "Frame size inconsistency.";
+  CHECK(model->input_blob->shape()[2] == net_image_height) << "Frame size inconsistency.";
+  CHECK(model->input_blob->shape()[3] == net_image_width) << "Frame size inconsistency.";
+
+  // output blob
+  const std::vector<caffe::Blob<float>*>& output_blobs = model->network->output_blobs();
+  model->output_blob = output_blobs[0];
+  CHECK(model->output_blob->shape()[0] == 1) << "Output consists of prediction for a single frame";
+  CHECK(model->output_blob->shape()[1] == n_outputs) << "Expected " << n_outputs << " outputs.";
+
+  // reshape once for the largest batch such that smaller batches do not
+  // reallocate
+  if(batch_size > 1) {
+    model->input_blob->Reshape(std::vector<int>{batch_size, n_channels, net_image_height, net_image_width});
+    model->network->Reshape();
+  }
+
+  // the first pass allocates buffers and, on the GPU, initializes kernels,
+  // so it is done before the model drives
+  float* input_data = model->input_blob->mutable_cpu_data();
+  std::fill(input_data, input_data + model->input_blob->count(), 0.f);
+  model->Forward();
+  return model;
+}
+
+
+// frame preprocessed into network input
+struct PreparedFrame {
+  // index of the car and its FrameSource
+  int car;
+  Frame frame;
+  // time the frame was acquired
+  std::chrono::steady_clock::time_point acquired;
+  std::vector<float> input;
+  // resized frame in interleaved layout for display
+  std::vector<uint8_t> preview;
+};
+
+// Acquire frames from a FrameSource and preprocess them into
+// PreparedFrames.
+class FramePreparer {
+  public:
+    FramePreparer(const caffe::TransformationParameter& param, bool check)
+      : preprocess(image_width, image_height, net_image_width, net_image_height, n_channels),
+        transformation(param, n_channels, net_image_height, net_image_width),
+        check(check), transformer(param, caffe::TEST),
+        reference_blob(std::vector<int>{1, n_channels, net_image_height, net_image_width})
+    {
+      init_datum(reference_datum);
+    }
+
+    // acquire the latest frame of source and preprocess it into prepared,
+    // returns false if there was no frame or it was overwritten while it was
+    // read
+    bool operator()(FrameSource* source, PreparedFrame* prepared) {
+      if(!source->acquire_frame(&prepared->frame)) return false;
+      prepared->acquired = std::chrono::steady_clock::now();
+      const uint8_t* data = prepared->frame.data;
+      preprocess(data, prepared->input.data(), transformation.mean(), transformation.scale(),
+                 prepared->preview.empty() ? nullptr : prepared->preview.data(), net_image_width * n_channels);
+      if(check) {
+        copy_img_to_datum(data, reference_datum);
+        transformer.Transform(reference_datum, &reference_blob);
+        CHECK(std::equal(reference_blob.cpu_data(), reference_blob.cpu_data() + reference_blob.count(), prepared->input.data())) <<
+          "Fused preprocessing differs from reference implementation.";
       }
+      return source->frame_valid(prepared->frame);
+    }
+
+  protected:
+    FramePreprocessor preprocess;
+    InputTransformation<float> transformation;
+    // reference preprocessing
+    bool check;
+    caffe::DataTransformer<float> transformer;
+    caffe::Datum reference_datum;
+    caffe::Blob<float> reference_blob;
+};
 
-      // clean up
-      cvReleaseImage(&input_img);
-      cvReleaseImage(&net_img);
+
+// Hand items from one producing to one consuming thread such that neither
+// blocks the other and the consumer always gets the latest item. The
+// producer fills back() and publishes it, the consumer acquires the latest
+// published item which stays valid until the next call to acquire.
+template <class T>
+class TripleBuffer {
+  public:
+    explicit TripleBuffer(const T& init)
+      : buffers{init, init, init}, back_idx(0), ready_idx(1), front_idx(2), fresh(false) {}
+
+    T& back() { return buffers[back_idx]; }
+
+    void publish() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::swap(back_idx, ready_idx);
+        fresh = true;
+      }
+      condition.notify_one();
     }
 
-    void apply_speed_control(const float desired_speed) {
-      if (desired_speed >= speed) {
-        accelCmd = 0.2*(desired_speed - speed + 1);
-        if(accelCmd > 1) accelCmd = 1.0;
-        brakeCmd = 0.0;
-      } else {
-        brakeCmd = 0.1*(speed - desired_speed);
-        if(brakeCmd > 1) brakeCmd = 1.0;
-        accelCmd = 0.0;
+    // wait at most timeout_us microseconds for a new item, returns nullptr
+    // on timeout
+    T* acquire(long timeout_us) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if(!condition.wait_for(lock, std::chrono::microseconds(timeout_us), [this]() { return fresh; })) {
+        return nullptr;
       }
+      std::swap(front_idx, ready_idx);
+      fresh = false;
+      return &buffers[front_idx];
     }
+
+  protected:
+    T buffers[3];
+    int back_idx, ready_idx, front_idx;
+    bool fresh;
+    std::mutex mutex;
+    std::condition_variable condition;
 };
 
 
+// Collect prepared frames of several cars into batches. Every car has a
+// single frame in flight: its thread offers the prepared frame and blocks
+// until the frame was answered, the consumer gathers batches of offered
+// frames and marks them as answered after sending their commands.
+class FrameBatcher {
+  public:
+    FrameBatcher(int n_cars, int max_batch, long deadline_us)
+      : states(n_cars, idle), ready_since(n_cars), n_ready(0), next_car(0),
+        max_batch(max_batch), deadline_us(deadline_us), stopped(false) {}
+
+    // offer the prepared frame of car and wait until it was answered,
+    // returns false if the batcher was stopped
+    bool offer(int car) {
+      std::unique_lock<std::mutex> lock(mutex);
+      states[car] = ready;
+      ready_since[car] = std::chrono::steady_clock::now();
+      n_ready += 1;
+      ready_condition.notify_one();
+      answered_condition.wait(lock, [&]() { return states[car] == idle || stopped; });
+      return !stopped;
+    }
+
+    // wait at most timeout_us microseconds for a frame, then wait until
+    // max_batch frames are ready or the oldest ready frame waited for
+    // deadline_us microseconds. Returns the cars of the batch or an empty
+    // batch on timeout. first_ready is set to the time the oldest frame of
+    // the batch was offered.
+    std::vector<int> gather(long timeout_us, std::chrono::steady_clock::time_point* first_ready) {
+      std::unique_lock<std::mutex> lock(mutex);
+      std::vector<int> batch;
+      if(!ready_condition.wait_for(lock, std::chrono::microseconds(timeout_us), [&]() { return n_ready > 0; })) {
+        return batch;
+      }
+      auto oldest = std::chrono::steady_clock::time_point::max();
+      for(unsigned int car = 0; car < states.size(); ++car) {
+        if(states[car] == ready) oldest = std::min(oldest, ready_since[car]);
+      }
+      ready_condition.wait_until(lock, oldest + std::chrono::microseconds(deadline_us),
+                                 [&]() { return n_ready >= max_batch || stopped; });
+      // round robin such that no car starves if more than max_batch are ready
+      *first_ready = std::chrono::steady_clock::time_point::max();
+      for(unsigned int i = 0; i < states.size() && (int)batch.size() < max_batch; ++i) {
+        int car = (next_car + i) % states.size();
+        if(states[car] != ready) continue;
+        states[car] = in_batch;
+        n_ready -= 1;
+        batch.push_back(car);
+        *first_ready = std::min(*first_ready, ready_since[car]);
+      }
+      if(!batch.empty()) next_car = (batch.back() + 1) % states.size();
+      return batch;
+    }
+
+    // release the cars of a gathered batch
+    void answered(const std::vector<int>& batch) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(int car : batch) {
+          states[car] = idle;
+        }
+      }
+      answered_condition.notify_all();
+    }
+
+    // wake up all waiting threads
+    void stop() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+      }
+      ready_condition.notify_all();
+      answered_condition.notify_all();
+    }
 
-// Show frames in leveldb
+  protected:
+    enum State { idle, ready, in_batch };
+    std::vector<State> states;
+    std::vector<std::chrono::steady_clock::time_point> ready_since;
+    int n_ready;
+    int next_car;
+    int max_batch;
+    long deadline_us;
+    bool stopped;
+    std::mutex mutex;
+    std::condition_variable ready_condition;
+    std::condition_variable answered_condition;
+};
+
+
+// Drive in torcs using the network
 int main(int argc, char** argv) {
   google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
 
-  if(argc != 4) {
-    LOG(ERROR) << "Usage: " << argv[0] << " input_network input_weights normalization_param_blob";
+  if(argc != 3 && argc != 4) {
+    LOG(ERROR) << "Usage: " << argv[0] << " input_network input_weights [normalization_param_blob]";
     return 1;
   }
 
-  // TODO currently this is hardcoded to use GPU 0 but it should try to
-  // detect if there is a GPU and which one is best to use.
-  const int gpu_idx = 0;
-  caffe::Caffe::SetDevice(gpu_idx);
-  caffe::Caffe::DeviceQuery();
-  caffe::Caffe::set_mode(caffe::Caffe::GPU);
-  // setup datum to be read
-  caffe::Datum datum;
+  // Lock memory before anything is allocated and raise the priority of the
+  // threads that exist so far, e.g. those of BLAS. Threads started later
+  // inherit the priority.
+  if(FLAGS_realtime) {
+    lock_memory();
+    set_realtime_priority(FLAGS_realtime_priority);
+  }
+
+  select_device(FLAGS_device);
+  set_compute_threads(FLAGS_threads);
+
+  CHECK(FLAGS_cars >= 1) << "Need at least one car.";
+  const bool batched = FLAGS_cars > 1;
+  const int max_batch = FLAGS_max_batch > 0 ? std::min(FLAGS_max_batch, FLAGS_cars) : FLAGS_cars;
 
   // Caffe model
   // First load prototxt describing the deployment setup
   caffe::NetParameter network_params;
   caffe::ReadProtoFromTextFile(argv[1], &network_params);
-  caffe::Net<float> network(network_params);
-  // Now load trained weights and copy as applicable
-  caffe::NetParameter trained_network_params;
-  caffe::ReadNetParamsFromBinaryFileOrDie(argv[2], &trained_network_params);
-  network.CopyTrainedLayersFrom(trained_network_params);
+  // Now load trained weights
+  const std::string weights_fname(argv[2]);
+  std::unique_ptr<DrivingModel> model = load_model(network_params, weights_fname, max_batch);
+  CHECK(model) << "Can not read weights from " << weights_fname;
+  if(!FLAGS_int8_calibration.empty()) LOG(INFO) << "Running " << FLAGS_int8_layers << " in int8.";
+  if(batched) LOG(INFO) << "Driving " << FLAGS_cars << " cars in batches of up to " << max_batch << " frames.";
 
   // expected shape
   std::vector<int> shape{n_channels, net_image_height, net_image_width};
 
-  // input blob
-  const std::vector<caffe::Blob<float>*>& input_blobs = network.input_blobs();
-  CHECK(input_blobs.size() == 1) << "Expected a single input blob.";
-  caffe::Blob<float>* input_blob = input_blobs[0];
-  CHECK(input_blob->shape()[0] == 1) << "Input consists of a single frame.";
-  CHECK(input_blob->shape()[1] == shape[0]) << "Frame size inconsistency.";
-  CHECK(input_blob->shape()[2] == shape[1]) << "Frame size inconsistency.";
-  CHECK(input_blob->shape()[3] == shape[2]) << "Frame size inconsistency.";
+  // Preprocessing from torcs frames to network input including the input
+  // transformation, one preparer per car as they keep state
+  auto transformation_param = model->network->layers()[0]->layer_param().transform_param();
+  std::vector<std::unique_ptr<FramePreparer>> preparers;
+  for(int car = 0; car < FLAGS_cars; ++car) {
+    preparers.emplace_back(new FramePreparer(transformation_param, FLAGS_check_preprocessing));
+  }
+  const int frame_size = n_channels * net_image_height * net_image_width;
+  // the preview is needed for display and recording
+#ifdef HEADLESS
+  const bool preview = !FLAGS_record.empty();
+#else
+  const bool preview = true;
+#endif
+  PreparedFrame initial_frame{0, Frame(), std::chrono::steady_clock::time_point(),
+                              std::vector<float>(frame_size), std::vector<uint8_t>(preview ? frame_size : 0)};
+  // Data normalizer, not needed if the network denormalizes itself
+  std::unique_ptr<LinearNormalizer<float>> normalizer;
+  if(has_folded_normalization(*model->network)) {
+    LOG(INFO) << "Network outputs denormalized values.";
+    if(argc == 4) LOG(WARNING) << "Ignoring " << argv[3] << ", the network outputs denormalized values.";
+  } else {
+    CHECK(argc == 4) << "Network outputs normalized values, normalization_param_blob is required.";
+    std::string normalization_fname(argv[3]);
+    normalizer.reset(new LinearNormalizer<float>(normalization_fname));
+  }
 
-  // output blob
-  const std::vector<caffe::Blob<float>*>& output_blobs = network.output_blobs();
-  caffe::Blob<float>* output_blob = output_blobs[0];
-  CHECK(output_blob->shape()[0] == 1) << "Output consists of prediction for a single frame";
-  CHECK(output_blob->shape()[1] == n_outputs) << "Expected " << n_outputs << " outputs.";
-
-  // Data transformer
-  auto transformation_param = network.layers()[0]->layer_param().transform_param();
-  caffe::DataTransformer<float> transformer(transformation_param, caffe::TEST);
-  // Data normalizer
-  std::string normalization_fname(argv[3]);
-  LinearNormalizer<float> normalizer(normalization_fname);
-
-  // Shared memory - see also man shmget
-  key_t shm_key = (key_t)4567;  // torcs must use the same
-  int perm = 0600;             // permission mode
-  int shm_flags = IPC_CREAT | perm;
-  int shm_id = shmget(shm_key, sizeof(SharedStruct), shm_flags);
-  CHECK(shm_id != -1) << "shmget() unsuccessful.";
-  SharedStruct* shm_struct = (SharedStruct*)shmat(shm_id, 0, 0);
-  CHECK(shm_struct != (SharedStruct*)-1) << "shmat() unsuccessful.";
-  shm_struct->clear();
-  shm_struct->init_datum(datum);
+  // Shared memory, one segment per car
+  std::vector<std::unique_ptr<FrameSource>> sources;
+  for(int car = 0; car < FLAGS_cars; ++car) {
+    if(FLAGS_shm_protocol == "legacy") {
+      SharedStruct* shm_struct = attach_shared_struct(FLAGS_shm_key + car);
+      shm_struct->clear();
+      sources.emplace_back(new LegacyFrameSource(shm_struct, FLAGS_shm_poll_us, FLAGS_shm_spin_us));
+    } else if(FLAGS_shm_protocol == "ring") {
+      SharedRing* shm_ring = attach_shared_ring(FLAGS_shm_key + car);
+      shm_ring->init(FLAGS_ring_slots);
+      sources.emplace_back(new RingFrameSource(shm_ring, FLAGS_shm_poll_us, FLAGS_shm_spin_us));
+    } else {
+      LOG(FATAL) << "Unknown shared memory protocol: " << FLAGS_shm_protocol;
+    }
+    if(FLAGS_realtime) lock_shared_memory(FLAGS_shm_key + car);
+  }
 
+  // Recording
+  std::unique_ptr<SessionRecorder> recorder;
+  if(!FLAGS_record.empty()) {
+    recorder.reset(new SessionRecorder(FLAGS_record, n_channels, net_image_height, net_image_width,
+                                       FLAGS_record_queue, FLAGS_record_batch,
+                                       FrameEncoding(FLAGS_record_encode, FLAGS_record_encode_quality)));
+  }
+
+  // Control
+  std::unique_ptr<ControlSocket> control_socket;
+  if(!FLAGS_control_socket.empty()) {
+    control_socket.reset(new ControlSocket(FLAGS_control_socket));
+  }
+
+#ifndef HEADLESS
+  // Visualization of frame
+  IplImage* frame_img = cvCreateImage(cvSize(net_image_width, net_image_height), IPL_DEPTH_8U, n_channels);
   // Visalization of steering angle
   const unsigned int box_width = 280;
   const unsigned int box_height = 60;
@@ -208,63 +515,268 @@ int main(int argc, char** argv) {
   IplImage* window_img = cvCreateImage(cvSize(box_width, box_height), IPL_DEPTH_8U, 3);
   cvSet(window_img, cvScalar(0,0,0));
   cvShowImage("Steering Command", window_img);
-
+#endif
+
+  RateCounter fps("Frames", FLAGS_fps_interval);
+  // latencies of the stages of the control loop. wait is the time spent
+  // waiting for torcs, total the time from acquiring a frame to answering it
+  LatencyStats stats(FLAGS_stats_interval, FLAGS_stats_file);
+  LatencyHistogram& wait_latency = stats.add("wait");
+  LatencyHistogram& preprocess_latency = stats.add("preprocess");
+  LatencyHistogram& forward_latency = stats.add("forward");
+  LatencyHistogram& denormalize_latency = stats.add("denormalize");
+  LatencyHistogram& send_latency = stats.add("send");
+  LatencyHistogram& total_latency = stats.add("total");
+  // time from the first frame of a batch being ready to its prediction
+  LatencyHistogram* gather_latency = batched ? &stats.add("gather") : nullptr;
+  DeadlineScheduler scheduler(FLAGS_cars, FLAGS_deadline_us, FLAGS_deadline_policy, FLAGS_deadline_max_fallbacks, stats);
   float desired_speed = 10;
-  while(1) {
-    if(shm_struct->written == 1) {
-      // load image into datum to be able to apply transformer
-      shm_struct->copy_img_to_datum(datum);
-      // predict current frame
-      transformer.Transform(datum, input_blob);
-      network.Forward();
-      normalizer.Denormalize(output_blob);
+
+  // answer a prepared frame with a steering command and speed control
+  auto answer = [&](PreparedFrame& prepared, float steer, bool predicted) {
+    Commands commands;
+    commands.steer = steer;
+    apply_speed_control(commands, desired_speed, prepared.frame.ground_truth.speed);
+    auto start = std::chrono::steady_clock::now();
+    sources[prepared.car]->send_commands(prepared.frame, commands);
+    send_latency.record_since(start);
+    total_latency.record_since(prepared.acquired);
+    scheduler.answered(prepared.car, steer, prepared.acquired, predicted);
+    fps.tick();
+    if(recorder) {
+      recorder->record(prepared.preview.data(), targets_from_ground_truth(prepared.frame.ground_truth, commands));
+    }
+  };
+
+  // predict a batch of prepared frames, answer them and visualize the
+  // prediction for the first car. Frames that would miss their deadline
+  // are answered or dropped before.
+  auto drive = [&](const std::vector<PreparedFrame*>& frames) {
+    std::vector<PreparedFrame*> batch;
+    for(PreparedFrame* prepared : frames) {
+      float steer;
+      if(!scheduler.late(prepared->acquired)) {
+        batch.push_back(prepared);
+      } else if(scheduler.policy() == DeadlineScheduler::latest) {
+        if(sources[prepared->car]->newer_frame(prepared->frame)) {
+          scheduler.drop();
+        } else {
+          batch.push_back(prepared);
+        }
+      } else if(scheduler.fallback(prepared->car, &steer)) {
+        answer(*prepared, steer, false);
+      } else {
+        batch.push_back(prepared);
+      }
+    }
+    if(batch.empty()) return;
+
+    auto start = std::chrono::steady_clock::now();
+    caffe::Blob<float>* input_blob = model->input_blob;
+    caffe::Blob<float>* output_blob = model->output_blob;
+    if(batched) {
+      if(input_blob->shape()[0] != (int)batch.size()) {
+        input_blob->Reshape(std::vector<int>{(int)batch.size(), shape[0], shape[1], shape[2]});
+        model->network->Reshape();
+      }
+      float* input_data = input_blob->mutable_cpu_data();
+      for(unsigned int i = 0; i < batch.size(); ++i) {
+        std::copy(batch[i]->input.begin(), batch[i]->input.end(), input_data + i * frame_size);
+      }
+    } else {
+      input_blob->set_cpu_data(batch[0]->input.data());
+    }
+    model->Forward();
+    forward_latency.record_since(start);
+    scheduler.forward_took(std::chrono::steady_clock::now() - start);
+    start = std::chrono::steady_clock::now();
+    if(normalizer) normalizer->Denormalize(output_blob);
+    denormalize_latency.record_since(start);
+
+    for(unsigned int i = 0; i < batch.size(); ++i) {
       // raw output data
-      const float* output_data = output_blob->cpu_data();
-      // visualize steering command
-      float steering_command = output_data[n_outputs - 1];
-
-      // apply steering command
-      shm_struct->steerCmd = steering_command;
-      // apply speed control
-      shm_struct->apply_speed_control(desired_speed);
-
-      // visualize
-      cvSet(window_img, cvScalar(0,0,0));
-      cvRectangle(window_img,
-                  cvPoint(box_width / 2, 0),
-                  cvPoint(box_width / 2 - scale_sc * steering_command, box_height),
-                  cvScalar(237,99,157), -2);
-
-      // use a constant name for the window otherwise a new window is created on each call
-      cvShowImage("Steering Command", window_img);
-
-      // signal that data is stale
-      shm_struct->written = 0;
+      const float* output_data = output_blob->cpu_data() + i * n_outputs;
+      answer(*batch[i], output_data[n_outputs - 1], true);
     }
 
-    auto key = cvWaitKey(1);
-    if(key == ASCII_ESC || key == 'q') {
-      shm_struct->pause = 0;
-      break;
-    } else if(key == 'p') {
-      shm_struct->pause = 1 - shm_struct->pause;
-    } else if(key == 'w') {
-      shm_struct->accelCmd = 0.2;
-      shm_struct->brakeCmd = 0;
-    } else if(key == 's') {
-      shm_struct->accelCmd = 0;
-      shm_struct->brakeCmd = 0.5;
-    } else if(key == 'a') {
-      shm_struct->steerCmd = +0.25;
-    } else if(key == 'd') {
-      shm_struct->steerCmd = -0.25;
-    } else if(key == '+') {
+#ifndef HEADLESS
+    // visualize the first car if it is part of the batch
+    auto shown = std::find_if(batch.begin(), batch.end(), [](const PreparedFrame* p) { return p->car == 0; });
+    if(shown == batch.end()) return;
+    const PreparedFrame& prepared = **shown;
+    float steering_command = output_blob->cpu_data()[(shown - batch.begin()) * n_outputs + n_outputs - 1];
+    for(int h = 0; h < net_image_height; ++h) {
+      std::copy(prepared.preview.begin() + h * net_image_width * n_channels,
+                prepared.preview.begin() + (h + 1) * net_image_width * n_channels,
+                frame_img->imageData + h * frame_img->widthStep);
+    }
+    cvShowImage("Frame", frame_img);
+    cvSet(window_img, cvScalar(0,0,0));
+    cvRectangle(window_img,
+                cvPoint(box_width / 2, 0),
+                cvPoint(box_width / 2 - scale_sc * steering_command, box_height),
+                cvScalar(237,99,157), -2);
+
+    // use a constant name for the window otherwise a new window is created on each call
+    cvShowImage("Steering Command", window_img);
+#endif
+  };
+
+  // apply a control command to all cars, returns false to quit
+  const std::set<std::string> car_commands{"quit", "pause", "accelerate", "brake", "left", "right"};
+  auto control = [&](const std::string& command) {
+    if(command == "faster") {
       desired_speed += 1;
-    } else if(key == '-') {
+    } else if(command == "slower") {
       desired_speed -= 1;
+    } else if(command.compare(0, 6, "speed ") == 0) {
+      desired_speed = atof(command.c_str() + 6);
+    } else if(car_commands.count(command) == 0) {
+      LOG(WARNING) << "Unknown control command: " << command;
+    }
+    for(auto& source : sources) {
+      Commands commands = source->commands();
+      if(command == "quit") {
+        source->set_pause(0);
+      } else if(command == "pause") {
+        source->set_pause(1 - source->pause());
+      } else if(command == "accelerate") {
+        commands.accel = 0.2;
+        commands.brake = 0;
+        source->override_commands(commands);
+      } else if(command == "brake") {
+        commands.accel = 0;
+        commands.brake = 0.5;
+        source->override_commands(commands);
+      } else if(command == "left") {
+        commands.steer = +0.25;
+        source->override_commands(commands);
+      } else if(command == "right") {
+        commands.steer = -0.25;
+        source->override_commands(commands);
+      }
+    }
+    return command != "quit";
+  };
+
+  // wait for the next frame of a car and preprocess it
+  auto wait_and_prepare = [&](int car, long timeout_us, PreparedFrame* prepared) {
+    auto start = std::chrono::steady_clock::now();
+    if(!sources[car]->wait_frame(timeout_us)) return false;
+    wait_latency.record_since(start);
+    start = std::chrono::steady_clock::now();
+    if(!(*preparers[car])(sources[car].get(), prepared)) return false;
+    preprocess_latency.record_since(start);
+    return true;
+  };
+
+  // preprocess on a separate thread and hand over the latest frame
+  TripleBuffer<PreparedFrame> prepared_frames(initial_frame);
+  PreparedFrame prepared_frame(initial_frame);
+  std::atomic<bool> running(true);
+  std::thread preparing;
+  if(FLAGS_pipeline && !batched) {
+    preparing = std::thread([&]() {
+      while(running.load()) {
+        if(wait_and_prepare(0, 100000, &prepared_frames.back())) {
+          prepared_frames.publish();
+        }
+      }
+    });
+  }
+
+  // with several cars, every car prepares its frames on its own thread and
+  // the main thread predicts batches of them
+  FrameBatcher batcher(FLAGS_cars, max_batch, FLAGS_batch_deadline_us);
+  std::vector<PreparedFrame> car_frames(batched ? FLAGS_cars : 0, initial_frame);
+  std::vector<std::thread> car_threads;
+  if(batched) {
+    for(int car = 0; car < FLAGS_cars; ++car) {
+      car_frames[car].car = car;
+      car_threads.emplace_back([&, car]() {
+        while(running.load()) {
+          if(wait_and_prepare(car, 100000, &car_frames[car])) {
+            batcher.offer(car);
+          }
+        }
+      });
     }
+  }
+
+  // load changed weights in the background, on the same device and with
+  // the same number of compute threads as the main thread
+  std::unique_ptr<ModelWatcher<DrivingModel>> watcher;
+  if(FLAGS_watch_weights_ms > 0) {
+    const int gpu = current_gpu();
+    watcher.reset(new ModelWatcher<DrivingModel>(weights_fname, FLAGS_watch_weights_ms, [&, gpu](const std::string& fname) {
+      // loading must not preempt the control loop
+      set_normal_priority();
+      use_gpu(gpu);
+      set_compute_threads(FLAGS_threads);
+      return load_model(network_params, fname, max_batch);
+    }));
+    LOG(INFO) << "Watching " << weights_fname << " for new weights.";
+  }
 
+  // pin all threads including those started by BLAS. The control thread
+  // also runs the forward pass and is the master thread of BLAS/OpenMP, so
+  // with --control_cpus its share of inference runs on those cores and the
+  // remaining compute threads run on --cpus.
+  set_cpu_affinity(FLAGS_cpus);
+  if(!FLAGS_control_cpus.empty()) pin_current_thread(FLAGS_control_cpus);
+
+  auto last_control_update = std::chrono::steady_clock::now();
+  bool driving = true;
+  while(driving) {
+    // switch to new weights between frames
+    if(watcher && watcher->take(model)) {
+      LOG(INFO) << "Driving with new weights from " << weights_fname;
+    }
+    // wait for the next frame but wake up in time to serve the controls
+    auto control_due_us = std::max<long>(std::chrono::duration_cast<std::chrono::microseconds>(
+        last_control_update + std::chrono::milliseconds(FLAGS_control_interval_ms) - std::chrono::steady_clock::now()).count(), 0);
+    if(batched) {
+      std::chrono::steady_clock::time_point first_ready;
+      auto cars = batcher.gather(control_due_us, &first_ready);
+      if(!cars.empty()) {
+        gather_latency->record_since(first_ready);
+        std::vector<PreparedFrame*> batch;
+        for(int car : cars) {
+          batch.push_back(&car_frames[car]);
+        }
+        drive(batch);
+        batcher.answered(cars);
+      }
+    } else if(FLAGS_pipeline) {
+      PreparedFrame* prepared = prepared_frames.acquire(control_due_us);
+      if(prepared != nullptr) drive({prepared});
+    } else {
+      if(wait_and_prepare(0, control_due_us, &prepared_frame)) drive({&prepared_frame});
+    }
+
+    if(std::chrono::steady_clock::now() - last_control_update < std::chrono::milliseconds(FLAGS_control_interval_ms)) {
+      continue;
+    }
+    last_control_update = std::chrono::steady_clock::now();
+    stats.maybe_report();
+    std::string command;
+    while(driving && control_socket && control_socket->receive(&command)) {
+      driving = control(command);
+    }
+#ifndef HEADLESS
+    auto key = cvWaitKey(1);
+    auto val = bindings.find(key);
+    if(driving && val != bindings.end()) {
+      driving = control(val->second);
+    }
+#endif
+  }
 
+  running.store(false);
+  batcher.stop();
+  if(preparing.joinable()) preparing.join();
+  for(auto& thread : car_threads) {
+    thread.join();
   }
 
   return 0;
@@ -0,0 +1,131 @@
+#include "utils.h"
+#include "device.h"
+#include "quantized_net.h"
+
+#include <caffe/data_transformer.hpp>
+
+#include <gflags/gflags.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+
+const int n_outputs = 15;
+
+DEFINE_string(network_prototxt, "network_deploy.prototxt", "Prototxt describing network architecture.");
+DEFINE_string(network_caffemodel, "network_weights.caffemodel", "Caffemodel with the weights to use for network.");
+DEFINE_string(normalization_protobinary, "torcs_train_normalization.binaryproto", "Protobinary containing Blob with normalization parameters.");
+DEFINE_string(calibration_db, "torcs_train_input", "Database containing frames to calibrate the quantization on.");
+DEFINE_int32(calibration_frames, 500, "Number of frames to calibrate on.");
+DEFINE_string(test_db, "torcs_test_input", "Database containing frames to compare float and int8 predictions on.");
+DEFINE_int32(test_frames, 1000, "Number of frames to compare on. 0 for all.");
+DEFINE_string(quantized_layers, default_quantized_layers, "Comma separated names of the layers to compute in int8.");
+DEFINE_string(calibration, "network_int8_calibration.binaryproto", "File to write the calibration to, see drive_torcs --int8_calibration.");
+DEFINE_int32(threads, 0, "Number of BLAS/OpenMP threads of float inference and of threads of int8 inference. 0 uses the library default and the number of cores for int8.");
+
+// Calibrate the int8 quantization of a network and compare its predictions
+// against the float network.
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Calibrate int8 inference of a network and report its deviation from float inference in denormalized units.");
+
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  // quantized inference is implemented for the CPU only
+  select_device("cpu");
+  set_compute_threads(FLAGS_threads);
+
+  // Caffe model
+  caffe::NetParameter network_params;
+  caffe::ReadProtoFromTextFile(FLAGS_network_prototxt, &network_params);
+  caffe::Net<float> network(network_params);
+  caffe::NetParameter trained_network_params;
+  caffe::ReadNetParamsFromBinaryFileOrDie(FLAGS_network_caffemodel, &trained_network_params);
+  network.CopyTrainedLayersFrom(trained_network_params);
+
+  const std::vector<caffe::Blob<float>*>& input_blobs = network.input_blobs();
+  CHECK(input_blobs.size() == 1) << "Expected a single input blob.";
+  caffe::Blob<float>* input_blob = input_blobs[0];
+  CHECK(input_blob->shape()[0] == 1) << "Input consists of a single frame.";
+  caffe::Blob<float>* output_blob = network.output_blobs()[0];
+  CHECK(output_blob->count() == n_outputs) << "Expected " << n_outputs << " outputs.";
+
+  auto transformation_param = network.layers()[0]->layer_param().transform_param();
+  caffe::DataTransformer<float> transformer(transformation_param, caffe::TEST);
+  std::unique_ptr<LinearNormalizer<float>> normalizer;
+  if(!has_folded_normalization(network)) {
+    normalizer.reset(new LinearNormalizer<float>(FLAGS_normalization_protobinary));
+  }
+
+  QuantizedNet quantized_network(network, split_layer_names(FLAGS_quantized_layers), FLAGS_threads);
+
+  leveldb::Options options;
+  options.error_if_exists = false;
+  options.create_if_missing = false;
+  options.max_open_files = 100;
+  caffe::Datum datum;
+
+  // calibrate
+  auto calibration_db = open_leveldb(FLAGS_calibration_db, options);
+  auto it = calibration_db->NewIterator(leveldb::ReadOptions());
+  int count = 0;
+  for(it->SeekToFirst(); it->Valid() && count < FLAGS_calibration_frames; it->Next()) {
+    datum.ParseFromString(it->value().ToString());
+    transformer.Transform(datum, input_blob);
+    quantized_network.observe();
+    count += 1;
+  }
+  delete it;
+  delete calibration_db;
+  std::cout << "Calibrated on " << count << " frames." << std::endl;
+  quantized_network.save_calibration(FLAGS_calibration);
+  std::cout << "Wrote calibration to " << FLAGS_calibration << std::endl;
+
+  // compare
+  std::vector<double> abs_error(n_outputs, 0), squared_error(n_outputs, 0), max_error(n_outputs, 0);
+  std::vector<float> float_output(n_outputs);
+  double float_seconds = 0, quantized_seconds = 0;
+  auto test_db = open_leveldb(FLAGS_test_db, options);
+  it = test_db->NewIterator(leveldb::ReadOptions());
+  count = 0;
+  for(it->SeekToFirst(); it->Valid() && (FLAGS_test_frames <= 0 || count < FLAGS_test_frames); it->Next()) {
+    datum.ParseFromString(it->value().ToString());
+    transformer.Transform(datum, input_blob);
+
+    auto start = std::chrono::steady_clock::now();
+    network.Forward();
+    float_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if(normalizer) normalizer->Denormalize(output_blob);
+    std::copy(output_blob->cpu_data(), output_blob->cpu_data() + n_outputs, float_output.begin());
+
+    start = std::chrono::steady_clock::now();
+    quantized_network.Forward();
+    quantized_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if(normalizer) normalizer->Denormalize(output_blob);
+
+    const float* quantized_output = output_blob->cpu_data();
+    for(int i = 0; i < n_outputs; ++i) {
+      double error = std::abs(quantized_output[i] - float_output[i]);
+      abs_error[i] += error;
+      squared_error[i] += error * error;
+      max_error[i] = std::max(max_error[i], error);
+    }
+    count += 1;
+  }
+  delete it;
+  delete test_db;
+  CHECK(count > 0) << "No frames to compare on in " << FLAGS_test_db;
+
+  std::cout << "Deviation of int8 from float predictions over " << count << " frames (output "
+    << n_outputs - 1 << " is the steering command):" << std::endl;
+  std::cout << std::setw(8) << "output" << std::setw(14) << "mean_abs" << std::setw(14) << "rmse" << std::setw(14) << "max_abs" << std::endl;
+  for(int i = 0; i < n_outputs; ++i) {
+    std::cout << std::setw(8) << i << std::setw(14) << abs_error[i] / count
+      << std::setw(14) << std::sqrt(squared_error[i] / count) << std::setw(14) << max_error[i] << std::endl;
+  }
+  std::cout << "Mean time per frame: float " << 1000 * float_seconds / count << " ms, int8 "
+    << 1000 * quantized_seconds / count << " ms (" << float_seconds / quantized_seconds << "x)." << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,273 @@
+#include "utils.h"
+#include "torcs_shm.h"
+#include "stats.h"
+#include "datum_codec.h"
+
+#include <gflags/gflags.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+DEFINE_int32(shm_key, shm_key, "Key of the shared memory segment, drive_torcs must use the same.");
+DEFINE_string(shm_protocol, "legacy", "Shared memory protocol: legacy (single frame, see SharedStruct) or ring (see SharedRing).");
+DEFINE_double(fps, 20, "Rate in frames per second to publish frames at. 0 to publish the next frame as soon as the previous one is answered.");
+DEFINE_int32(frames, 0, "Number of frames to publish before exiting, the database is replayed as often as necessary. 0 to run forever.");
+DEFINE_int32(timeout_ms, 1000, "Time in milliseconds to wait for an answer if --fps is 0, or for an answer that missed the next frame otherwise.");
+DEFINE_int32(shm_poll_us, 200, "Interval in microseconds to recheck for an answer if drive_torcs does not wake us.");
+DEFINE_double(stats_interval, 10, "Interval in seconds to report response latencies. 0 to disable.");
+DEFINE_string(stats_file, "", "File to write latency reports to. Empty to log them.");
+
+
+// Convert a frame of the database into the format torcs delivers: upscaled
+// to image_width x image_height, bottom-up rows and RGB instead of BGR. This
+// is the inverse of copy_img_to_datum in drive_torcs.cpp.
+class FrameConverter {
+  public:
+    FrameConverter(const std::vector<unsigned int>& shape) {
+      CHECK(shape[0] == n_channels) << "Expected frames with " << n_channels << " channels.";
+      frame_img = cvCreateImage(cvSize(shape[2], shape[1]), IPL_DEPTH_8U, n_channels);
+      torcs_img = cvCreateImage(cvSize(image_width, image_height), IPL_DEPTH_8U, n_channels);
+    }
+
+    ~FrameConverter() {
+      cvReleaseImage(&frame_img);
+      cvReleaseImage(&torcs_img);
+    }
+
+    void operator()(const caffe::Datum& datum, uint8_t* data) {
+      datum_to_ipl(datum, frame_img);
+      cvResize(frame_img, torcs_img);
+      for(int h = 0; h < image_height; ++h) {
+        const uint8_t* row = (const uint8_t*)(torcs_img->imageData + h * torcs_img->widthStep);
+        uint8_t* torcs_row = data + (image_height - 1 - h) * image_width * n_channels;
+        for(int w = 0; w < image_width; ++w) {
+          for(int c = 0; c < n_channels; ++c) {
+            torcs_row[w * n_channels + c] = row[w * n_channels + (n_channels - 1 - c)];
+          }
+        }
+      }
+    }
+
+  protected:
+    IplImage* frame_img;
+    IplImage* torcs_img;
+};
+
+
+// Producer side of either shared memory protocol.
+class FrameSink {
+  public:
+    virtual ~FrameSink() {}
+
+    // buffer to write the image of the next frame into
+    virtual uint8_t* begin_frame() = 0;
+    virtual void publish_frame(const GroundTruth& ground_truth) = 0;
+    // wait for the answer of the last published frame, returns false on
+    // timeout
+    virtual bool wait_answer(long timeout_us) = 0;
+    // true if a frame can be written, i.e. the last one was answered or
+    // the protocol does not require it
+    virtual bool ready() = 0;
+    virtual Commands commands() = 0;
+    virtual int pause() = 0;
+};
+
+class LegacyFrameSink : public FrameSink {
+  public:
+    LegacyFrameSink(SharedStruct* shm, long poll_us) : shm(shm), poll_us(poll_us) {}
+
+    uint8_t* begin_frame() { return shm->data; }
+
+    void publish_frame(const GroundTruth& ground_truth) {
+      shm->set_ground_truth(ground_truth);
+      shm->publish();
+    }
+
+    bool wait_answer(long timeout_us) {
+      return shm->wait_released(timeout_us, poll_us);
+    }
+
+    bool ready() {
+      return shm->written.load(std::memory_order_acquire) == 0;
+    }
+
+    Commands commands() {
+      return {shm->steerCmd, shm->accelCmd, shm->brakeCmd};
+    }
+
+    int pause() { return shm->pause; }
+
+  protected:
+    SharedStruct* shm;
+    long poll_us;
+};
+
+class RingFrameSink : public FrameSink {
+  public:
+    RingFrameSink(SharedRing* ring, long poll_us) : ring(ring), poll_us(poll_us), frame(0) {}
+
+    uint8_t* begin_frame() {
+      slot = &ring->begin_frame(frame + 1);
+      return slot->data;
+    }
+
+    void publish_frame(const GroundTruth& ground_truth) {
+      frame += 1;
+      slot->ground_truth = ground_truth;
+      ring->publish_frame(frame);
+    }
+
+    bool wait_answer(long timeout_us) {
+      return ring->wait_answer(frame, timeout_us, poll_us);
+    }
+
+    // frames are never blocked on the consumer
+    bool ready() { return true; }
+
+    Commands commands() {
+      int answered;
+      return ring->read_commands(&answered);
+    }
+
+    int pause() { return ring->pause; }
+
+  protected:
+    SharedRing* ring;
+    long poll_us;
+    int frame;
+    SharedRingSlot* slot;
+};
+
+
+// Stand-in for torcs: replay the frames of a leveldb over shared memory and
+// measure how fast drive_torcs answers them.
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if(argc != 2) {
+    LOG(ERROR) << "Usage: " << argv[0] << " input_db";
+    return 1;
+  }
+
+  std::string dbname(argv[1]);
+  leveldb::Options options;
+  options.error_if_exists = false;
+  options.create_if_missing = false;
+  options.max_open_files = 100;
+  auto db = open_leveldb(dbname, options);
+  auto shape = infer_shape(db);
+  std::cout << "Inferred shape: " << shape[0] << " " << shape[1] << " " << shape[2] << std::endl;
+  FrameConverter convert(shape);
+
+  // Shared memory. drive_torcs owns the ring and initializes it, the legacy
+  // segment is created here like torcs does.
+  std::unique_ptr<FrameSink> sink;
+  if(FLAGS_shm_protocol == "legacy") {
+    SharedStruct* shm_struct = attach_shared_struct(FLAGS_shm_key);
+    shm_struct->clear();
+    sink.reset(new LegacyFrameSink(shm_struct, FLAGS_shm_poll_us));
+  } else if(FLAGS_shm_protocol == "ring") {
+    SharedRing* shm_ring = attach_shared_ring(FLAGS_shm_key);
+    LOG(INFO) << "Waiting for drive_torcs to initialize the ring.";
+    while(!shm_ring->compatible()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    sink.reset(new RingFrameSink(shm_ring, FLAGS_shm_poll_us));
+  } else {
+    LOG(FATAL) << "Unknown shared memory protocol: " << FLAGS_shm_protocol;
+  }
+
+  // response is the time from publishing a frame to its answer, jitter the
+  // difference between the response times of consecutive frames
+  LatencyStats stats(FLAGS_stats_interval, FLAGS_stats_file);
+  LatencyHistogram& response_latency = stats.add("response");
+  LatencyHistogram& response_jitter = stats.add("jitter");
+
+  const auto period = std::chrono::nanoseconds(FLAGS_fps > 0 ? (long long)(1e9 / FLAGS_fps) : 0);
+
+  caffe::Datum datum;
+  GroundTruth ground_truth{};
+  auto it = db->NewIterator(leveldb::ReadOptions());
+  it->SeekToFirst();
+  unsigned int count = 0, missed = 0, interval_count = 0, interval_missed = 0;
+  long long last_response_ns = -1;
+  auto next_due = std::chrono::steady_clock::now();
+  auto last_published = next_due;
+  auto last_report = next_due;
+  while(FLAGS_frames <= 0 || count < (unsigned int)FLAGS_frames) {
+    if(sink->pause()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      next_due = std::chrono::steady_clock::now();
+      continue;
+    }
+
+    // a legacy consumer has to answer before the next frame can be written
+    while(!sink->ready()) {
+      if(!sink->wait_answer(FLAGS_timeout_ms * 1000L)) {
+        LOG(INFO) << "Waiting for drive_torcs to answer.";
+      }
+    }
+
+    if(!it->Valid()) it->SeekToFirst();
+    datum.ParseFromString(it->value().ToString());
+    decode_datum(&datum);
+    it->Next();
+
+    std::this_thread::sleep_until(next_due);
+    convert(datum, sink->begin_frame());
+    auto published = std::chrono::steady_clock::now();
+    sink->publish_frame(ground_truth);
+    count += 1;
+    interval_count += 1;
+    next_due = (FLAGS_fps > 0 ? next_due : published) + period;
+
+    // answers arriving after the next frame is due count as missed. They
+    // are still waited for up to --timeout_ms so that their response time
+    // is recorded. The next frame is then published late, and the ones
+    // after it catch up with the schedule.
+    long answer_timeout_us = FLAGS_timeout_ms * 1000L;
+    if(FLAGS_fps > 0) {
+      answer_timeout_us = std::max<long>(std::chrono::duration_cast<std::chrono::microseconds>(next_due - std::chrono::steady_clock::now()).count(), 0);
+    }
+    bool answered = sink->wait_answer(answer_timeout_us);
+    if(!answered) {
+      missed += 1;
+      interval_missed += 1;
+      if(FLAGS_fps > 0) answered = sink->wait_answer(FLAGS_timeout_ms * 1000L);
+    }
+    if(answered) {
+      long long response_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - published).count();
+      response_latency.record(response_ns);
+      if(last_response_ns >= 0) response_jitter.record(std::abs(response_ns - last_response_ns));
+      last_response_ns = response_ns;
+    }
+
+    // simple vehicle model such that the speed control of drive_torcs
+    // settles
+    Commands commands = sink->commands();
+    double dt = std::chrono::duration<double>(published - last_published).count();
+    last_published = published;
+    ground_truth.speed = std::max(ground_truth.speed + (10 * commands.accel - 20 * commands.brake) * dt, 0.0);
+
+    stats.maybe_report();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_report).count();
+    if(FLAGS_stats_interval > 0 && elapsed >= FLAGS_stats_interval) {
+      LOG(INFO) << "Published " << interval_count << " frames at " << interval_count / elapsed << " per second, missed "
+        << 100.0 * interval_missed / interval_count << "%.";
+      interval_count = 0;
+      interval_missed = 0;
+      last_report = std::chrono::steady_clock::now();
+    }
+  }
+  delete it;
+
+  std::cout << "Published a total of " << count << " frames, missed " << missed
+    << " (" << 100.0 * missed / std::max(count, 1u) << "%)." << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include "utils.h"
+
+#include <gflags/gflags.h>
+
+#include <iostream>
+#include <random>
+
+DEFINE_string(network_prototxt, "network_deploy.prototxt", "Prototxt describing network architecture.");
+DEFINE_string(network_caffemodel, "network_weights.caffemodel", "Caffemodel with the weights to use for network.");
+DEFINE_string(normalization_protobinary, "torcs_train_normalization.binaryproto", "Protobinary containing Blob with normalization parameters.");
+DEFINE_string(output_prototxt, "network_deploy_denormalized.prototxt", "Prototxt to write the network with folded denormalization to.");
+DEFINE_string(output_caffemodel, "network_weights_denormalized.caffemodel", "Caffemodel to write the weights of the network with folded denormalization to.");
+
+// Fold the denormalization of the targets into a network such that it
+// outputs denormalized values directly. The output of network_deploy.prototxt
+// passes through a sigmoid after the last InnerProduct layer, so the linear
+// transformation can not be folded into its weights. Instead, a Scale layer
+// with the slopes and biases of the denormalization is appended, which is
+// also where further affine post-processing can be folded into.
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Append the denormalization of the targets to a network such that it outputs denormalized values.");
+
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  caffe::Caffe::set_mode(caffe::Caffe::CPU);
+
+  caffe::NetParameter network_params;
+  caffe::ReadProtoFromTextFile(FLAGS_network_prototxt, &network_params);
+  CHECK(network_params.layer_size() > 0) << "No layers in " << FLAGS_network_prototxt;
+  caffe::Net<float> network(network_params);
+  caffe::NetParameter trained_network_params;
+  caffe::ReadNetParamsFromBinaryFileOrDie(FLAGS_network_caffemodel, &trained_network_params);
+  network.CopyTrainedLayersFrom(trained_network_params);
+  CHECK(!has_folded_normalization(network)) << "Denormalization is already folded into " << FLAGS_network_prototxt;
+
+  // y = (x - bias) / slope, see LinearNormalizer::Denormalize
+  caffe::BlobProto normalization_blob_proto;
+  caffe::ReadProtoFromBinaryFileOrDie(FLAGS_normalization_protobinary, &normalization_blob_proto);
+  caffe::Blob<float> normalization_blob;
+  normalization_blob.FromProto(normalization_blob_proto);
+  CHECK(normalization_blob.num_axes() == 2 && normalization_blob.shape(1) == 2) << "Normalization blob should have two columns.";
+  const int n_outputs = normalization_blob.shape(0);
+  caffe::Blob<float>* output_blob = network.output_blobs()[0];
+  CHECK(output_blob->count(1) == n_outputs) << "Network has " << output_blob->count(1) << " outputs but normalization "
+    << n_outputs << " rows.";
+
+  // scale the output of the last layer in place
+  const std::string output_name = network_params.layer(network_params.layer_size() - 1).top(0);
+  caffe::LayerParameter* denormalize = network_params.add_layer();
+  denormalize->set_name(folded_normalization_layer);
+  denormalize->set_type("Scale");
+  denormalize->add_bottom(output_name);
+  denormalize->add_top(output_name);
+  denormalize->mutable_scale_param()->set_axis(1);
+  denormalize->mutable_scale_param()->set_num_axes(1);
+  denormalize->mutable_scale_param()->set_bias_term(true);
+
+  caffe::Net<float> folded_network(network_params);
+  folded_network.CopyTrainedLayersFrom(trained_network_params);
+  auto layer = folded_network.layer_by_name(folded_normalization_layer);
+  const float* normalization_params = normalization_blob.cpu_data();
+  float* slope = layer->blobs()[0]->mutable_cpu_data();
+  float* bias = layer->blobs()[1]->mutable_cpu_data();
+  for(int i = 0; i < n_outputs; ++i) {
+    slope[i] = 1 / normalization_params[i*2 + 0];
+    bias[i] = -normalization_params[i*2 + 1] / normalization_params[i*2 + 0];
+  }
+
+  // compare against the normalizer on a random input
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<float> uniform(-100, 100);
+  caffe::Blob<float>* input_blob = network.input_blobs()[0];
+  for(int i = 0; i < input_blob->count(); ++i) {
+    input_blob->mutable_cpu_data()[i] = uniform(rng);
+  }
+  folded_network.input_blobs()[0]->CopyFrom(*input_blob);
+  network.Forward();
+  folded_network.Forward();
+  LinearNormalizer<float> normalizer(FLAGS_normalization_protobinary);
+  normalizer.Denormalize(output_blob);
+  float max_difference = 0;
+  for(int i = 0; i < n_outputs; ++i) {
+    float difference = std::abs(output_blob->cpu_data()[i] - folded_network.output_blobs()[0]->cpu_data()[i]);
+    max_difference = std::max(max_difference, difference / std::max(1.f, std::abs(output_blob->cpu_data()[i])));
+  }
+  std::cout << "Maximum relative difference to LinearNormalizer: " << max_difference << std::endl;
+  CHECK(max_difference < 1e-4) << "Folded denormalization differs from LinearNormalizer.";
+
+  caffe::WriteProtoToTextFile(network_params, FLAGS_output_prototxt);
+  caffe::NetParameter folded_weights;
+  folded_network.ToProto(&folded_weights, false);
+  caffe::WriteProtoToBinaryFile(folded_weights, FLAGS_output_caffemodel);
+  std::cout << "Wrote " << FLAGS_output_prototxt << " and " << FLAGS_output_caffemodel << std::endl;
+
+  return 0;
+}
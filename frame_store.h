@@ -0,0 +1,168 @@
+#pragma once
+
+#include <glog/logging.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// A frame store is a flat file holding a dataset of frames of fixed shape
+// together with their regression targets:
+//
+// header: FrameStoreHeader, padded to frame_store_alignment bytes
+// frames: count frames of channels * height * width bytes each, in the
+//   (channel, height, width) layout of caffe::Datum
+// targets: count rows of n_targets floats each, starting at the next
+//   multiple of frame_store_alignment after the frames
+//
+// Frame i and its targets are at fixed offsets, such that the store can be
+// memory mapped and read without parsing. See convert_frame_store.cpp.
+const char frame_store_magic[8] = {'T', 'O', 'R', 'C', 'S', 'F', 'S', '1'};
+const uint64_t frame_store_alignment = 4096;
+
+struct FrameStoreHeader {
+  char magic[8];
+  uint32_t channels, height, width;
+  uint32_t n_targets;
+  uint64_t count;
+  uint64_t frames_offset;
+  uint64_t targets_offset;
+};
+
+inline uint64_t align_frame_store_offset(uint64_t offset)
+{
+  return (offset + frame_store_alignment - 1) / frame_store_alignment * frame_store_alignment;
+}
+
+
+// Read-only memory mapping of a frame store.
+class FrameStore {
+  public:
+    explicit FrameStore(const std::string& fname) : fname(fname) {
+      int fd = open(fname.c_str(), O_RDONLY);
+      CHECK(fd >= 0) << "Can not open frame store " << fname << ": " << strerror(errno);
+      struct stat info;
+      CHECK(fstat(fd, &info) == 0) << "Can not stat " << fname;
+      size = info.st_size;
+      CHECK(size >= sizeof(FrameStoreHeader)) << fname << " is too small to be a frame store.";
+      data = (const uint8_t*)mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      CHECK(data != MAP_FAILED) << "Can not map " << fname << ": " << strerror(errno);
+      close(fd);
+
+      memcpy(&header, data, sizeof(header));
+      CHECK(memcmp(header.magic, frame_store_magic, sizeof(frame_store_magic)) == 0) << fname << " is not a frame store.";
+      CHECK(header.frames_offset + header.count * frame_size() <= header.targets_offset &&
+            header.targets_offset + header.count * header.n_targets * sizeof(float) <= size) << "Truncated frame store " << fname;
+    }
+
+    ~FrameStore() {
+      munmap((void*)data, size);
+    }
+
+    FrameStore(const FrameStore&) = delete;
+    FrameStore& operator=(const FrameStore&) = delete;
+
+    uint64_t count() const { return header.count; }
+    std::vector<unsigned int> shape() const { return {header.channels, header.height, header.width}; }
+    unsigned int n_targets() const { return header.n_targets; }
+    size_t frame_size() const { return (size_t)header.channels * header.height * header.width; }
+
+    const uint8_t* frame(uint64_t i) const {
+      return data + header.frames_offset + i * frame_size();
+    }
+
+    const float* targets(uint64_t i) const {
+      return (const float*)(data + header.targets_offset) + i * header.n_targets;
+    }
+
+    // hint the expected access pattern, e.g. MADV_SEQUENTIAL or MADV_RANDOM
+    void advise(int advice) const {
+      madvise((void*)data, size, advice);
+    }
+
+    // start reading frame i and its targets in the background
+    void will_need(uint64_t i) const {
+      will_need(frame(i), frame_size());
+      will_need((const uint8_t*)targets(i), header.n_targets * sizeof(float));
+    }
+
+  protected:
+    void will_need(const uint8_t* begin, size_t length) const {
+      uintptr_t page_begin = (uintptr_t)begin / frame_store_alignment * frame_store_alignment;
+      madvise((void*)page_begin, (uintptr_t)begin + length - page_begin, MADV_WILLNEED);
+    }
+
+    std::string fname;
+    const uint8_t* data;
+    size_t size;
+    FrameStoreHeader header;
+};
+
+
+// Write a frame store sequentially. The targets are kept in memory until
+// close, where they are appended after the frames and the header is
+// written with the final count.
+class FrameStoreWriter {
+  public:
+    FrameStoreWriter(const std::string& fname, unsigned int channels, unsigned int height, unsigned int width, unsigned int n_targets)
+      : fname(fname)
+    {
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, frame_store_magic, sizeof(frame_store_magic));
+      header.channels = channels;
+      header.height = height;
+      header.width = width;
+      header.n_targets = n_targets;
+      header.frames_offset = align_frame_store_offset(sizeof(header));
+      file = fopen(fname.c_str(), "wb");
+      CHECK(file != nullptr) << "Can not create frame store " << fname;
+      pad_to(header.frames_offset);
+    }
+
+    ~FrameStoreWriter() {
+      if(file != nullptr) close();
+    }
+
+    // frame holds channels * height * width bytes in (channel, height,
+    // width) layout
+    void add(const std::string& frame, const float* frame_targets) {
+      CHECK(frame.size() == (size_t)header.channels * header.height * header.width) << "Frame has " << frame.size() << " bytes, expected "
+        << header.channels << "x" << header.height << "x" << header.width << ".";
+      CHECK(fwrite(frame.data(), 1, frame.size(), file) == frame.size()) << "Could not write to " << fname;
+      targets.insert(targets.end(), frame_targets, frame_targets + header.n_targets);
+      header.count += 1;
+    }
+
+    uint64_t count() const { return header.count; }
+
+    void close() {
+      header.targets_offset = align_frame_store_offset(header.frames_offset + header.count * header.channels * header.height * header.width);
+      pad_to(header.targets_offset);
+      CHECK(fwrite(targets.data(), sizeof(float), targets.size(), file) == targets.size()) << "Could not write to " << fname;
+      CHECK(fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1) << "Could not write to " << fname;
+      CHECK(fclose(file) == 0) << "Could not write to " << fname;
+      file = nullptr;
+    }
+
+  protected:
+    void pad_to(uint64_t offset) {
+      long position = ftell(file);
+      CHECK(position >= 0 && (uint64_t)position <= offset) << "Invalid offset in " << fname;
+      std::vector<char> padding(offset - position, 0);
+      CHECK(fwrite(padding.data(), 1, padding.size(), file) == padding.size()) << "Could not write to " << fname;
+    }
+
+    std::string fname;
+    FILE* file;
+    FrameStoreHeader header;
+    std::vector<float> targets;
+};
@@ -0,0 +1,121 @@
+#include "utils.h"
+#include "frame_store.h"
+
+#include <caffe/layer.hpp>
+#include <caffe/util/math_functions.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <random>
+
+namespace caffe {
+
+// Data layer reading a frame store (see frame_store.h) through a memory
+// mapping. Frames are converted from the mapping directly into the first
+// top blob of shape (batch_size, channels, height, width), applying the
+// mean and scale of transform_param. Their targets go into the second top
+// blob of shape (batch_size, n_targets). Configured by data_param, where
+// source is the frame store and batch_size the number of frames per batch:
+//
+// layer {
+//   name: "data"
+//   type: "FrameStoreData"
+//   top: "data"
+//   top: "targets"
+//   data_param { source: "torcs_train.frames" batch_size: 128 }
+//   transform_param { mean_file: "torcs_train_mean.binaryproto" }
+// }
+//
+// In the TRAIN phase, the frames are visited in a new random order in every
+// epoch. While a batch is processed, the pages of the next one are read in
+// the background.
+template <typename Dtype>
+class FrameStoreDataLayer : public Layer<Dtype> {
+  public:
+    explicit FrameStoreDataLayer(const LayerParameter& param)
+      : Layer<Dtype>(param), position(0) {}
+
+    virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+      const DataParameter& data_param = this->layer_param_.data_param();
+      store.reset(new FrameStore(data_param.source()));
+      batch_size = data_param.batch_size();
+      CHECK(batch_size > 0) << "batch_size must be positive.";
+      CHECK(store->count() > 0) << "Empty frame store " << data_param.source();
+      auto shape = store->shape();
+      LOG(INFO) << "Opened frame store " << data_param.source() << " with " << store->count() << " frames of shape "
+        << shape[0] << "x" << shape[1] << "x" << shape[2] << " and " << store->n_targets() << " targets.";
+      transformation.reset(new InputTransformation<Dtype>(this->layer_param_.transform_param(), shape[0], shape[1], shape[2]));
+
+      order.resize(store->count());
+      std::iota(order.begin(), order.end(), 0);
+      shuffle = this->phase_ == TRAIN;
+      if(shuffle) {
+        random_engine.seed(caffe_rng_rand());
+        std::shuffle(order.begin(), order.end(), random_engine);
+      }
+      store->advise(shuffle ? MADV_RANDOM : MADV_SEQUENTIAL);
+      prefetch();
+    }
+
+    virtual void Reshape(const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+      auto shape = store->shape();
+      top[0]->Reshape(batch_size, shape[0], shape[1], shape[2]);
+      top[1]->Reshape(std::vector<int>{batch_size, (int)store->n_targets()});
+    }
+
+    virtual inline const char* type() const { return "FrameStoreData"; }
+    virtual inline int ExactNumBottomBlobs() const { return 0; }
+    virtual inline int ExactNumTopBlobs() const { return 2; }
+
+  protected:
+    virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+      const size_t frame_size = store->frame_size();
+      const unsigned int n_targets = store->n_targets();
+      const Dtype* mean = transformation->mean();
+      const Dtype scale = transformation->scale();
+      Dtype* data = top[0]->mutable_cpu_data();
+      Dtype* targets = top[1]->mutable_cpu_data();
+      for(int item = 0; item < batch_size; ++item) {
+        const uint8_t* frame = store->frame(order[position]);
+        for(size_t j = 0; j < frame_size; ++j) {
+          data[item * frame_size + j] = (frame[j] - mean[j]) * scale;
+        }
+        const float* frame_targets = store->targets(order[position]);
+        std::copy(frame_targets, frame_targets + n_targets, targets + item * n_targets);
+        next();
+      }
+      prefetch();
+    }
+
+    virtual void Backward_cpu(const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+                              const vector<Blob<Dtype>*>& bottom) {}
+
+    // advance to the next frame, starting a new epoch after the last
+    void next() {
+      position += 1;
+      if(position == order.size()) {
+        position = 0;
+        if(shuffle) std::shuffle(order.begin(), order.end(), random_engine);
+      }
+    }
+
+    // start reading the frames of the next batch
+    void prefetch() {
+      for(int item = 0; item < batch_size; ++item) {
+        store->will_need(order[(position + item) % order.size()]);
+      }
+    }
+
+    std::unique_ptr<FrameStore> store;
+    std::unique_ptr<InputTransformation<Dtype>> transformation;
+    int batch_size;
+    bool shuffle;
+    std::mt19937_64 random_engine;
+    std::vector<uint64_t> order;
+    size_t position;
+};
+
+REGISTER_LAYER_CLASS(FrameStoreData);
+
+}  // namespace caffe
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <glog/logging.h>
+
+#include <caffe/util/math_functions.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <vector>
+
+
+// Orthonormalize the rows of the (rows, cols) matrix a in place with
+// modified Gram-Schmidt. Rows that are linearly dependent on the previous
+// ones are set to zero.
+inline void orthonormalize_rows(std::vector<float>& a, int rows, int cols)
+{
+  for(int i = 0; i < rows; ++i) {
+    float* row = &a[i * cols];
+    // twice for numerical stability
+    for(int pass = 0; pass < 2; ++pass) {
+      for(int j = 0; j < i; ++j) {
+        const float* other = &a[j * cols];
+        double dot = 0;
+        for(int k = 0; k < cols; ++k) dot += (double)row[k] * other[k];
+        for(int k = 0; k < cols; ++k) row[k] -= (float)dot * other[k];
+      }
+    }
+    double norm = 0;
+    for(int k = 0; k < cols; ++k) norm += (double)row[k] * row[k];
+    norm = std::sqrt(norm);
+    float inv_norm = norm > 1e-12 ? (float)(1 / norm) : 0;
+    for(int k = 0; k < cols; ++k) row[k] *= inv_norm;
+  }
+}
+
+
+// Eigendecomposition of the symmetric (n, n) matrix a with cyclic Jacobi
+// rotations. Returns the eigenvalues in descending order, the
+// corresponding eigenvectors are stored in the rows of vectors.
+inline std::vector<double> symmetric_eigen(std::vector<double> a, int n, std::vector<double>& vectors)
+{
+  std::vector<double> v(n * n, 0);
+  for(int i = 0; i < n; ++i) v[i * n + i] = 1;
+
+  for(int sweep = 0; sweep < 100; ++sweep) {
+    double off = 0, diagonal = 0;
+    for(int i = 0; i < n; ++i) {
+      diagonal += a[i * n + i] * a[i * n + i];
+      for(int j = i + 1; j < n; ++j) off += a[i * n + j] * a[i * n + j];
+    }
+    if(off <= 1e-24 * diagonal) break;
+
+    for(int p = 0; p < n; ++p) {
+      for(int q = p + 1; q < n; ++q) {
+        double apq = a[p * n + q];
+        if(std::abs(apq) < 1e-300) continue;
+        // rotation that annihilates a[p][q], see Numerical Recipes
+        double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+        double t = (theta >= 0 ? 1 : -1) / (std::abs(theta) + std::sqrt(theta * theta + 1));
+        double c = 1 / std::sqrt(t * t + 1), s = t * c;
+        for(int k = 0; k < n; ++k) {
+          double akp = a[k * n + p], akq = a[k * n + q];
+          a[k * n + p] = c * akp - s * akq;
+          a[k * n + q] = s * akp + c * akq;
+        }
+        for(int k = 0; k < n; ++k) {
+          double apk = a[p * n + k], aqk = a[q * n + k];
+          a[p * n + k] = c * apk - s * aqk;
+          a[q * n + k] = s * apk + c * aqk;
+        }
+        // eigenvectors are accumulated in the rows of v
+        for(int k = 0; k < n; ++k) {
+          double vpk = v[p * n + k], vqk = v[q * n + k];
+          v[p * n + k] = c * vpk - s * vqk;
+          v[q * n + k] = s * vpk + c * vqk;
+        }
+      }
+    }
+  }
+
+  std::vector<int> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](int i, int j) { return a[i * n + i] > a[j * n + j]; });
+  std::vector<double> values(n);
+  vectors.resize(n * n);
+  for(int i = 0; i < n; ++i) {
+    values[i] = a[order[i] * n + order[i]];
+    std::copy(&v[order[i] * n], &v[order[i] * n] + n, &vectors[i * n]);
+  }
+  return values;
+}
+
+
+// Truncated SVD W ~ U S V^T of a (rows, cols) weight matrix computed with
+// randomized subspace iteration (Halko et al., "Finding structure with
+// randomness", 2011). The factorization is stored as first = S V^T of shape
+// (rank, cols) and second = U of shape (rows, rank), such that an
+// InnerProduct layer with weights W can be replaced by one with weights
+// first followed by one with weights second.
+struct LowRankFactorization {
+  int rows, cols, rank;
+  std::vector<float> first;
+  std::vector<float> second;
+  // squared singular values of all computed components in descending
+  // order and the squared Frobenius norm of W, i.e. their total
+  std::vector<double> energies;
+  double total_energy;
+
+  // fraction of the energy of W retained with rank components
+  double retained_energy(int rank) const {
+    return std::accumulate(energies.begin(), energies.begin() + rank, 0.0) / total_energy;
+  }
+};
+
+// Factorize w with max_rank components, plus oversampling to improve their
+// accuracy. The rank is given or, if 0, the smallest rank that retains the
+// fraction energy of the squared Frobenius norm of w.
+LowRankFactorization factorize_low_rank(const float* w, int rows, int cols, int rank, double energy, int max_rank,
+                                        int oversampling = 16, int power_iterations = 2, unsigned int seed = 0)
+{
+  CHECK(rank >= 0 && rank <= std::min(rows, cols)) << "Rank must be in [0, " << std::min(rows, cols) << "].";
+  if(rank > 0) max_rank = rank;
+  max_rank = std::min(max_rank, std::min(rows, cols));
+  const int l = std::min(max_rank + oversampling, std::min(rows, cols));
+
+  LowRankFactorization result;
+  result.rows = rows;
+  result.cols = cols;
+  result.total_energy = 0;
+  for(int i = 0; i < rows * cols; ++i) result.total_energy += (double)w[i] * w[i];
+
+  // range of w: rows of y span the column space of w
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> normal;
+  std::vector<float> omega(l * cols), y(l * rows), z(l * cols);
+  for(auto& x : omega) x = normal(rng);
+  caffe::caffe_cpu_gemm<float>(CblasNoTrans, CblasTrans, l, rows, cols, 1., omega.data(), w, 0., y.data());
+  orthonormalize_rows(y, l, rows);
+  for(int i = 0; i < power_iterations; ++i) {
+    caffe::caffe_cpu_gemm<float>(CblasNoTrans, CblasNoTrans, l, cols, rows, 1., y.data(), w, 0., z.data());
+    orthonormalize_rows(z, l, cols);
+    caffe::caffe_cpu_gemm<float>(CblasNoTrans, CblasTrans, l, rows, cols, 1., z.data(), w, 0., y.data());
+    orthonormalize_rows(y, l, rows);
+  }
+
+  // project w onto the range, b = Q^T w, and decompose b b^T = E L E^T
+  std::vector<float> b(l * cols), bbt(l * l);
+  caffe::caffe_cpu_gemm<float>(CblasNoTrans, CblasNoTrans, l, cols, rows, 1., y.data(), w, 0., b.data());
+  caffe::caffe_cpu_gemm<float>(CblasNoTrans, CblasTrans, l, l, cols, 1., b.data(), b.data(), 0., bbt.data());
+  std::vector<double> eigenvectors;
+  result.energies = symmetric_eigen(std::vector<double>(bbt.begin(), bbt.end()), l, eigenvectors);
+  result.energies.resize(max_rank);
+
+  if(rank == 0) {
+    rank = max_rank;
+    for(int r = 1; r <= max_rank; ++r) {
+      if(result.retained_energy(r) >= energy) {
+        rank = r;
+        break;
+      }
+    }
+    if(result.retained_energy(rank) < energy) {
+      LOG(WARNING) << "Rank " << max_rank << " retains only " << result.retained_energy(rank) << " of the energy.";
+    }
+  }
+  result.rank = rank;
+
+  // first = E_r^T b, second = Q E_r
+  std::vector<float> e(rank * l);
+  for(int i = 0; i < rank * l; ++i) e[i] = (float)eigenvectors[i];
+  result.first.resize(rank * cols);
+  result.second.resize(rows * rank);
+  caffe::caffe_cpu_gemm<float>(CblasNoTrans, CblasNoTrans, rank, cols, l, 1., e.data(), b.data(), 0., result.first.data());
+  caffe::caffe_cpu_gemm<float>(CblasTrans, CblasTrans, rows, rank, l, 1., y.data(), e.data(), 0., result.second.data());
+  return result;
+}
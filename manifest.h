@@ -0,0 +1,122 @@
+#pragma once
+
+#include "utils.h"
+
+#include <fstream>
+#include <string>
+
+
+// Summary of a dataset written next to the files of its leveldb by the tools
+// that create datasets, such that other tools need not scan the db to count
+// its entries. Stored as lines of name and value in <dbname>/DATASET.
+struct DatasetManifest {
+  DatasetManifest()
+    : count(0), channels(0), height(0), width(0), float_data_size(0), key_width(0) {}
+
+  // number of entries
+  uint64_t count;
+  // shape of the image and size of the float_data of the first datum
+  unsigned int channels, height, width;
+  unsigned int float_data_size;
+  // length of the first key
+  unsigned int key_width;
+  // last key, to notice dbs that were changed after the manifest was written
+  std::string last_key;
+  // the steps that produced the dataset, separated by semicolons
+  std::string provenance;
+
+  std::vector<unsigned int> shape() const { return {channels, height, width}; }
+
+  void add_step(const std::string& step) {
+    provenance = provenance.empty() ? step : provenance + "; " + step;
+  }
+};
+
+
+inline std::string manifest_fname(const std::string& dbname)
+{
+  return dbname + "/DATASET";
+}
+
+
+// returns false if dbname has no manifest
+inline bool read_manifest(const std::string& dbname, DatasetManifest* manifest)
+{
+  std::ifstream file(manifest_fname(dbname));
+  if(!file) return false;
+  std::string line;
+  while(std::getline(file, line)) {
+    size_t space = line.find(' ');
+    std::string name = line.substr(0, space),
+                value = space == std::string::npos ? "" : line.substr(space + 1);
+    if(name.empty()) continue;
+    if(name == "count") manifest->count = std::stoull(value);
+    else if(name == "channels") manifest->channels = std::stoul(value);
+    else if(name == "height") manifest->height = std::stoul(value);
+    else if(name == "width") manifest->width = std::stoul(value);
+    else if(name == "float_data_size") manifest->float_data_size = std::stoul(value);
+    else if(name == "key_width") manifest->key_width = std::stoul(value);
+    else if(name == "last_key") manifest->last_key = value;
+    else if(name == "provenance") manifest->provenance = value;
+    else LOG(WARNING) << "Ignoring unknown field " << name << " in " << manifest_fname(dbname);
+  }
+  return true;
+}
+
+
+inline void write_manifest(const std::string& dbname, const DatasetManifest& manifest)
+{
+  LOG(INFO) << "Writing manifest of " << dbname;
+  std::ofstream file(manifest_fname(dbname));
+  file << "count " << manifest.count << std::endl
+       << "channels " << manifest.channels << std::endl
+       << "height " << manifest.height << std::endl
+       << "width " << manifest.width << std::endl
+       << "float_data_size " << manifest.float_data_size << std::endl
+       << "key_width " << manifest.key_width << std::endl
+       << "last_key " << manifest.last_key << std::endl
+       << "provenance " << manifest.provenance << std::endl;
+  CHECK(file.good()) << "Could not write " << manifest_fname(dbname);
+}
+
+
+// Manifest of the leveldb dbname opened as db. If it has none or the db
+// changed since it was written, the manifest is inferred from the first
+// and last entry. The entries are then counted only if count is set, which
+// scans the whole db, and left at 0 otherwise.
+inline DatasetManifest dataset_manifest(const std::string& dbname, leveldb::DB* db, bool count = false)
+{
+  DatasetManifest manifest;
+  auto it = db->NewIterator(leveldb::ReadOptions());
+  it->SeekToLast();
+  CHECK(it->Valid()) << "Empty db: " << dbname;
+  const std::string last_key = it->key().ToString();
+  if(read_manifest(dbname, &manifest)) {
+    if(manifest.last_key == last_key) {
+      delete it;
+      return manifest;
+    }
+    LOG(WARNING) << "Ignoring manifest of " << dbname << " that does not match the db.";
+    manifest = DatasetManifest();
+  }
+
+  it->SeekToFirst();
+  caffe::Datum datum;
+  datum.ParseFromString(it->value().ToString());
+  manifest.channels = datum.channels();
+  manifest.height = datum.height();
+  manifest.width = datum.width();
+  manifest.float_data_size = datum.float_data_size();
+  manifest.key_width = it->key().size();
+  manifest.last_key = last_key;
+  manifest.provenance = dbname;
+  if(count) {
+    LOG(INFO) << dbname << " has no manifest, counting its entries.";
+    for(; it->Valid(); it->Next()) {
+      manifest.count += 1;
+    }
+    CHECK(it->status().ok()) << it->status().ToString();
+  }
+  delete it;
+  return manifest;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <sys/stat.h>
+
+
+// Identity of the contents of a file. Replacing the file, e.g. by renaming
+// a new one over it or by pointing a symlink to another file, changes the
+// inode, writing to it changes modification time or size.
+struct FileVersion {
+  bool exists;
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec modified;
+
+  bool operator==(const FileVersion& other) const {
+    return exists == other.exists && (!exists ||
+      (device == other.device && inode == other.inode && size == other.size &&
+       modified.tv_sec == other.modified.tv_sec && modified.tv_nsec == other.modified.tv_nsec));
+  }
+  bool operator!=(const FileVersion& other) const { return !(*this == other); }
+};
+
+inline FileVersion file_version(const std::string& fname)
+{
+  FileVersion version;
+  struct stat info;
+  version.exists = stat(fname.c_str(), &info) == 0;
+  if(version.exists) {
+    version.device = info.st_dev;
+    version.inode = info.st_ino;
+    version.size = info.st_size;
+    version.modified = info.st_mtim;
+  }
+  return version;
+}
+
+
+// Watch a file and load a Model from it on a background thread whenever it
+// changes. A change is only loaded once the file stayed the same for one
+// poll interval such that files which are still being written are skipped.
+// The consumer picks up the loaded model with take() between uses of its
+// current one, which costs a single atomic load if there is nothing new.
+// Replaced models are destroyed on the background thread as well.
+template <class Model>
+class ModelWatcher {
+  public:
+    // load returns nullptr if the file could not be loaded
+    typedef std::function<std::unique_ptr<Model>(const std::string&)> Loader;
+
+    ModelWatcher(const std::string& fname, int poll_ms, Loader load)
+      : fname(fname), poll_ms(poll_ms), load(load), loaded_version(file_version(fname)),
+        ready(false), stopped(false)
+    {
+      watching = std::thread(&ModelWatcher::watch, this);
+    }
+
+    ~ModelWatcher() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+      }
+      condition.notify_one();
+      watching.join();
+    }
+
+    // replace current by the latest loaded model if there is one, returns
+    // whether it was replaced
+    bool take(std::unique_ptr<Model>& current) {
+      if(!ready.load(std::memory_order_acquire)) return false;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        current.swap(pending);
+        retired = std::move(pending);
+        ready.store(false, std::memory_order_relaxed);
+      }
+      condition.notify_one();
+      return true;
+    }
+
+  protected:
+    void watch() {
+      FileVersion candidate = loaded_version;
+      std::unique_lock<std::mutex> lock(mutex);
+      while(!stopped) {
+        condition.wait_for(lock, std::chrono::milliseconds(poll_ms));
+        if(stopped) break;
+        std::unique_ptr<Model> old = std::move(retired);
+        lock.unlock();
+        old.reset();
+
+        FileVersion version = file_version(fname);
+        bool stable = version == candidate;
+        candidate = version;
+        if(stable && version.exists && version != loaded_version) {
+          auto start = std::chrono::steady_clock::now();
+          std::unique_ptr<Model> model = load(fname);
+          // only retry once the file changes again
+          loaded_version = version;
+          if(model) {
+            LOG(INFO) << "Loaded " << fname << " in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s.";
+            lock.lock();
+            // an older model that was not taken yet is superseded
+            old = std::move(pending);
+            pending = std::move(model);
+            ready.store(true, std::memory_order_release);
+            lock.unlock();
+            old.reset();
+          } else {
+            LOG(ERROR) << "Could not load " << fname << ", keeping the current model.";
+          }
+        }
+        lock.lock();
+      }
+    }
+
+    std::string fname;
+    int poll_ms;
+    Loader load;
+    FileVersion loaded_version;
+    std::unique_ptr<Model> pending;
+    std::unique_ptr<Model> retired;
+    std::atomic<bool> ready;
+    bool stopped;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread watching;
+};
@@ -1,12 +1,30 @@
 #include "utils.h"
+#include "manifest.h"
 
+#include <gflags/gflags.h>
+#include <leveldb/write_batch.h>
+
+#include <algorithm>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+
+DEFINE_int32(threads, 0, "Number of threads scanning and writing the db. 0 to use the number of cores.");
+DEFINE_int32(shards_per_thread, 4, "Number of key ranges per thread the db is split into for load balancing.");
+DEFINE_int32(batch_size, 256, "Number of entries written to out_db at once.");
+
 
 // Normalize float data to a specified interval and print parameters for
 // (de-)normalization. If out_db is specified, write normalized data into
-// it.
+// it. The db is split into key ranges that are scanned by --threads threads
+// in both passes.
 int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Normalize float data of a database to an interval.\n"
+                          "Usage: normalize [FLAGS] a b input_db output_blob [out_db]");
+
   google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
 
   if(argc != 5 && argc != 6) {
     LOG(ERROR) << "Usage: " << argv[0] << " a b input_db output_blob [out_db]";
@@ -25,41 +43,45 @@ int main(int argc, char** argv) {
   options.create_if_missing = false;
   options.max_open_files = 100;
   auto db = open_leveldb(dbname, options);
-  auto shape = infer_shape(db);
-  auto float_data_size = infer_float_data_size(db);
+  auto manifest = dataset_manifest(dbname, db);
+  auto shape = manifest.shape();
+  auto float_data_size = manifest.float_data_size;
   std::cout << "Inferred shape: " << shape[0] << " " << shape[1] << " " << shape[2] << std::endl;
   std::cout << "Inferred float_data_size: " << float_data_size << std::endl;
   CHECK(float_data_size > 0) << "Can not normalize dataset which contains no float data.";
 
-  // collect min and max of float fields
-  std::vector<float> mins(float_data_size),
-                     maxs(float_data_size);
-
-  // initialize with first datum
-  caffe::Datum datum;
-  auto it = db->NewIterator(leveldb::ReadOptions());
-  it->SeekToFirst();
-  datum.ParseFromString(it->value().ToString());
-  for(unsigned int i = 0; i < float_data_size; ++i) {
-    mins[i] = datum.float_data(i);
-  }
-
-  // iterate over rest
-  it->Next();
-  unsigned int count = 1;
-  unsigned int info_iter = 5000;
-  for(; it->Valid(); it->Next())
-  {
-    datum.ParseFromString(it->value().ToString());
-    for(unsigned int i = 0; i < float_data_size; ++i) {
-      mins[i] = std::min<float>(mins[i], datum.float_data(i));
-      maxs[i] = std::max<float>(maxs[i], datum.float_data(i));
+  const int n_threads = FLAGS_threads > 0 ? FLAGS_threads : std::max(1u, std::thread::hardware_concurrency());
+  const auto shards = shard_key_range(db, n_threads * std::max(1, FLAGS_shards_per_thread));
+  // the dbs are scanned once per pass
+  leveldb::ReadOptions read_options;
+  read_options.fill_cache = false;
+
+  // collect min and max of float fields per shard and reduce them
+  std::vector<float> mins(float_data_size, std::numeric_limits<float>::max()),
+                     maxs(float_data_size, std::numeric_limits<float>::lowest());
+  std::mutex mutex;
+  std::atomic<unsigned int> count(0);
+  for_each_shard(shards, n_threads, [&](const KeyRange& shard) {
+    std::vector<float> shard_mins(float_data_size, std::numeric_limits<float>::max()),
+                       shard_maxs(float_data_size, std::numeric_limits<float>::lowest());
+    caffe::Datum datum;
+    auto it = db->NewIterator(read_options);
+    for(it->Seek(shard.begin); it->Valid() && shard.contains(it->key()); it->Next()) {
+      datum.ParseFromString(it->value().ToString());
+      CHECK(datum.float_data_size() == (int)float_data_size) << "Inconsistent float_data_size for key " << it->key().ToString();
+      for(unsigned int i = 0; i < float_data_size; ++i) {
+        shard_mins[i] = std::min<float>(shard_mins[i], datum.float_data(i));
+        shard_maxs[i] = std::max<float>(shard_maxs[i], datum.float_data(i));
+      }
+      count_processed(count);
     }
-    if(count % info_iter == 0) {
-      std::cout << "Processed " << count << " entries." << std::endl;
+    delete it;
+    std::lock_guard<std::mutex> lock(mutex);
+    for(unsigned int i = 0; i < float_data_size; ++i) {
+      mins[i] = std::min(mins[i], shard_mins[i]);
+      maxs[i] = std::max(maxs[i], shard_maxs[i]);
     }
-    count += 1;
-  }
+  });
   std::cout << "Looked at a total of " << count << " keys." << std::endl;
 
   // compute slope and bias for each field
@@ -129,26 +151,47 @@ int main(int argc, char** argv) {
   output_options.max_open_files = 100;
   std::string out_dbname = std::string(argv[5]);
   auto out_db = open_leveldb(out_dbname, output_options);
-  std::string serialized_datum;
-  leveldb::WriteOptions write_options;
 
-  // iterate again over input database, normalize it and write to db
-  it->SeekToFirst();
+  // iterate again over input database, normalize it and write to db, leveldb
+  // supports concurrent writes
   count = 0;
-  for(; it->Valid(); it->Next()) {
-    datum.ParseFromString(it->value().ToString());
-    for(unsigned int i = 0; i < float_data_size; ++i) {
-      datum.set_float_data(i, normalization_parameters[i * 2 + 0] * datum.float_data(i) + normalization_parameters[i * 2 + 1]);
+  for_each_shard(shards, n_threads, [&](const KeyRange& shard) {
+    caffe::Datum datum;
+    std::string serialized_datum;
+    leveldb::WriteOptions write_options;
+    leveldb::WriteBatch batch;
+    int batched = 0;
+    auto it = db->NewIterator(read_options);
+    for(it->Seek(shard.begin); it->Valid() && shard.contains(it->key()); it->Next()) {
+      datum.ParseFromString(it->value().ToString());
+      for(unsigned int i = 0; i < float_data_size; ++i) {
+        datum.set_float_data(i, normalization_parameters[i * 2 + 0] * datum.float_data(i) + normalization_parameters[i * 2 + 1]);
+      }
+      datum.SerializeToString(&serialized_datum);
+      batch.Put(it->key(), serialized_datum);
+      batched += 1;
+      if(batched >= FLAGS_batch_size) {
+        auto s = out_db->Write(write_options, &batch);
+        CHECK(s.ok()) << s.ToString();
+        batch.Clear();
+        batched = 0;
+      }
+      count_processed(count);
     }
-    datum.SerializeToString(&serialized_datum);
-    out_db->Put(write_options, it->key().ToString(), serialized_datum);
-
-    if(count % info_iter == 0) {
-      std::cout << "Processed " << count << " entries." << std::endl;
+    delete it;
+    if(batched > 0) {
+      auto s = out_db->Write(write_options, &batch);
+      CHECK(s.ok()) << s.ToString();
     }
-    count += 1;
-  }
+  });
+  delete out_db;
   std::cout << "Wrote a total of " << count << " normalized entries to " << out_dbname << "." << std::endl;
 
+  manifest.count = count;
+  std::stringstream step;
+  step << "normalize to [" << a << ", " << b << "]";
+  manifest.add_step(step.str());
+  write_manifest(out_dbname, manifest);
+
   return 0;
 }
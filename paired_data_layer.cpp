@@ -0,0 +1,213 @@
+#include "utils.h"
+#include "bounded_queue.h"
+#include "datum_codec.h"
+
+#include <caffe/layer.hpp>
+#include <caffe/util/math_functions.hpp>
+
+#include <gflags/gflags.h>
+
+#include <future>
+#include <memory>
+#include <thread>
+#include <utility>
+
+DEFINE_int32(data_threads, 4, "Number of threads of every PairedData layer preparing batches.");
+
+namespace caffe {
+
+// Data layer reading the inputs and targets of a dataset in lockstep. The
+// first top blob of shape (batch_size, channels, height, width) receives
+// the frames with the mean and scale of transform_param applied, the second
+// of shape (batch_size, n_targets) the float_data of the targets. If
+// data_param.source is a leveldb, its datums hold both the frame and the
+// targets as before split.cpp. Otherwise the leveldbs <source>_input and
+// <source>_target are read with their keys checked to be identical:
+//
+// layer {
+//   name: "data"
+//   type: "PairedData"
+//   top: "data"
+//   top: "targets"
+//   data_param { source: "torcs_train" batch_size: 128 prefetch: 4 }
+//   transform_param { mean_file: "torcs_train_mean.binaryproto" }
+// }
+//
+// A reader thread reads data_param.prefetch batches ahead, which are parsed,
+// decoded and transformed by --data_threads threads. The dbs are read in the
+// order of their keys, starting over after the last one.
+template <typename Dtype>
+class PairedDataLayer : public Layer<Dtype> {
+  public:
+    explicit PairedDataLayer(const LayerParameter& param) : Layer<Dtype>(param) {}
+
+    virtual ~PairedDataLayer() {
+      if(reader.joinable()) {
+        free_batches->close();
+        ready->close();
+        work->close();
+        reader.join();
+      }
+      for(auto& worker : workers) {
+        worker.join();
+      }
+      for(auto db : dbs) {
+        delete db;
+      }
+    }
+
+    virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+      const DataParameter& data_param = this->layer_param_.data_param();
+      batch_size = data_param.batch_size();
+      CHECK(batch_size > 0) << "batch_size must be positive.";
+      leveldb::Options options;
+      options.error_if_exists = false;
+      options.create_if_missing = false;
+      options.max_open_files = 100;
+      auto combined_db = open_leveldb_nofail(data_param.source(), options);
+      if(combined_db != nullptr) {
+        dbs = {combined_db};
+      } else {
+        dbs = {open_leveldb(data_param.source() + "_input", options), open_leveldb(data_param.source() + "_target", options)};
+      }
+      shape = infer_shape(dbs.front());
+      n_targets = infer_float_data_size(dbs.back());
+      CHECK(n_targets > 0) << "The targets of " << data_param.source() << " contain no float data.";
+      LOG(INFO) << "Reading frames of shape " << shape[0] << "x" << shape[1] << "x" << shape[2] << " and "
+        << n_targets << " targets from " << data_param.source() << (dbs.size() == 1 ? "" : "_{input,target}");
+      transformation.reset(new InputTransformation<Dtype>(this->layer_param_.transform_param(), shape[0], shape[1], shape[2]));
+
+      // start prefetching
+      const int n_batches = std::max(1, (int)data_param.prefetch());
+      free_batches.reset(new BoundedQueue<std::shared_ptr<Batch>>(n_batches));
+      ready.reset(new BoundedQueue<std::future<std::shared_ptr<Batch>>>(n_batches));
+      work.reset(new BoundedQueue<Work>(n_batches));
+      const size_t frame_size = shape[0] * shape[1] * shape[2];
+      for(int i = 0; i < n_batches; ++i) {
+        std::shared_ptr<Batch> batch(new Batch);
+        batch->data.resize(batch_size * frame_size);
+        batch->targets.resize(batch_size * n_targets);
+        free_batches->push(batch);
+      }
+      reader = std::thread(&PairedDataLayer::read, this);
+      for(int i = 0; i < std::max(1, FLAGS_data_threads); ++i) {
+        workers.emplace_back(&PairedDataLayer::prepare, this);
+      }
+    }
+
+    virtual void Reshape(const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+      top[0]->Reshape(batch_size, shape[0], shape[1], shape[2]);
+      top[1]->Reshape(std::vector<int>{batch_size, (int)n_targets});
+    }
+
+    virtual inline const char* type() const { return "PairedData"; }
+    virtual inline int ExactNumBottomBlobs() const { return 0; }
+    virtual inline int ExactNumTopBlobs() const { return 2; }
+
+  protected:
+    // frames and targets of a batch after transformation
+    struct Batch {
+      std::vector<Dtype> data;
+      std::vector<Dtype> targets;
+    };
+    // serialized datums of every db to prepare into batch
+    struct Work {
+      std::shared_ptr<Batch> batch;
+      std::vector<std::vector<std::string>> values;
+      std::promise<std::shared_ptr<Batch>> result;
+    };
+
+    virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+      std::future<std::shared_ptr<Batch>> next;
+      CHECK(ready->pop(&next)) << "Data reader stopped.";
+      std::shared_ptr<Batch> batch = next.get();
+      caffe_copy(batch->data.size(), batch->data.data(), top[0]->mutable_cpu_data());
+      caffe_copy(batch->targets.size(), batch->targets.data(), top[1]->mutable_cpu_data());
+      free_batches->push(batch);
+    }
+
+    virtual void Backward_cpu(const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+                              const vector<Blob<Dtype>*>& bottom) {}
+
+    // read the values of batches into free batches and hand them to the
+    // workers in order
+    void read() {
+      leveldb::ReadOptions read_options;
+      read_options.fill_cache = false;
+      std::vector<leveldb::Iterator*> its;
+      for(auto db : dbs) {
+        its.push_back(db->NewIterator(read_options));
+        its.back()->SeekToFirst();
+      }
+      Work item;
+      while(free_batches->pop(&item.batch)) {
+        item.values.assign(dbs.size(), std::vector<std::string>(batch_size));
+        for(int i = 0; i < batch_size; ++i) {
+          if(!its[0]->Valid()) {
+            // start the next epoch
+            for(auto it : its) {
+              CHECK(!it->Valid()) << "The dbs of " << this->layer_param_.data_param().source() << " have different sizes.";
+              CHECK(it->status().ok()) << it->status().ToString();
+              it->SeekToFirst();
+            }
+            CHECK(its[0]->Valid()) << "Empty db " << this->layer_param_.data_param().source();
+          }
+          for(size_t db = 0; db < its.size(); ++db) {
+            CHECK(its[db]->Valid() && its[db]->key() == its[0]->key()) << "Input and target dbs are out of sync at key "
+              << its[0]->key().ToString();
+            item.values[db][i] = its[db]->value().ToString();
+          }
+          for(auto it : its) {
+            it->Next();
+          }
+        }
+        if(!ready->push(item.result.get_future()) || !work->push(std::move(item))) break;
+        item = Work();
+      }
+      for(auto it : its) {
+        delete it;
+      }
+    }
+
+    // parse, decode and transform the datums of batches
+    void prepare() {
+      const size_t frame_size = shape[0] * shape[1] * shape[2];
+      const Dtype* mean = transformation->mean();
+      const Dtype scale = transformation->scale();
+      caffe::Datum datum;
+      Work item;
+      while(work->pop(&item)) {
+        Batch& batch = *item.batch;
+        for(int i = 0; i < batch_size; ++i) {
+          datum.ParseFromString(item.values[0][i]);
+          decode_datum(&datum);
+          const std::string& frame = datum.data();
+          CHECK(frame.size() == frame_size) << "Frame has " << frame.size() << " bytes, expected " << frame_size << ".";
+          Dtype* data = batch.data.data() + i * frame_size;
+          for(size_t j = 0; j < frame_size; ++j) {
+            data[j] = ((uint8_t)frame[j] - mean[j]) * scale;
+          }
+          if(dbs.size() > 1) datum.ParseFromString(item.values[1][i]);
+          CHECK(datum.float_data_size() == (int)n_targets) << "Expected " << n_targets << " targets.";
+          std::copy(datum.float_data().begin(), datum.float_data().end(), batch.targets.begin() + i * n_targets);
+        }
+        item.result.set_value(item.batch);
+      }
+    }
+
+    int batch_size;
+    std::vector<unsigned int> shape;
+    unsigned int n_targets;
+    std::unique_ptr<InputTransformation<Dtype>> transformation;
+    // the combined db or the input and the target db
+    std::vector<leveldb::DB*> dbs;
+    std::unique_ptr<BoundedQueue<std::shared_ptr<Batch>>> free_batches;
+    std::unique_ptr<BoundedQueue<std::future<std::shared_ptr<Batch>>>> ready;
+    std::unique_ptr<BoundedQueue<Work>> work;
+    std::thread reader;
+    std::vector<std::thread> workers;
+};
+
+REGISTER_LAYER_CLASS(PairedData);
+
+}  // namespace caffe
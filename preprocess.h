@@ -0,0 +1,226 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// Fused preprocessing of frames as delivered by TORCS. The source image is
+// interleaved, stored bottom-up and with reversed channel order. A single
+// pass flips it, swaps the channels, resizes it bilinearly and scatters it
+// into planar (channel, height, width) layout as expected by caffe.
+//
+// The resize reproduces the fixed-point arithmetic of OpenCV's 8 bit
+// INTER_LINEAR resize (11 bit coefficients, SSE2 vertical pass with a
+// scalar tail) such that the result matches the former
+// flip -> cvResize -> scatter path bit by bit. drive_torcs can verify this
+// at run time with --check_preprocessing.
+//
+// All tables and row buffers are allocated in the constructor, processing
+// a frame does not allocate.
+class FramePreprocessor {
+  public:
+    static const int coef_bits = 11;
+    static const int coef_scale = 1 << coef_bits;
+
+    FramePreprocessor(int src_width, int src_height, int dst_width, int dst_height, int n_channels = 3)
+      : src_width(src_width), src_height(src_height),
+        dst_width(dst_width), dst_height(dst_height),
+        n_channels(n_channels),
+        row_width(dst_width * n_channels),
+        xofs(row_width), alpha(2 * row_width),
+        yofs(2 * dst_height), beta(2 * dst_height),
+        rows{std::vector<int>(row_width), std::vector<int>(row_width)},
+        cached_rows{-1, -1},
+        row(row_width)
+    {
+      // horizontal coefficients, see cv::resize
+      double scale_x = 1. / ((double)dst_width / src_width);
+      xmax = dst_width;
+      for(int dx = 0; dx < dst_width; ++dx) {
+        float fx = (float)((dx + 0.5) * scale_x - 0.5);
+        int sx = (int)std::floor(fx);
+        fx -= sx;
+        if(sx < 0) {
+          fx = 0, sx = 0;
+        }
+        if(sx + 1 >= src_width) {
+          xmax = std::min(xmax, dx);
+          if(sx >= src_width - 1) fx = 0, sx = src_width - 1;
+        }
+        short a0 = saturate_short(std::lrint((1.f - fx) * coef_scale)),
+              a1 = saturate_short(std::lrint(fx * coef_scale));
+        for(int c = 0; c < n_channels; ++c) {
+          // reading the reversed channel swaps BGR <-> RGB
+          xofs[dx * n_channels + c] = sx * n_channels + (n_channels - 1 - c);
+          alpha[(dx * n_channels + c) * 2 + 0] = a0;
+          alpha[(dx * n_channels + c) * 2 + 1] = a1;
+        }
+      }
+      xmax *= n_channels;
+
+      // vertical coefficients and source rows in memory order (bottom-up)
+      double scale_y = 1. / ((double)dst_height / src_height);
+      for(int dy = 0; dy < dst_height; ++dy) {
+        float fy = (float)((dy + 0.5) * scale_y - 0.5);
+        int sy = (int)std::floor(fy);
+        fy -= sy;
+        for(int k = 0; k < 2; ++k) {
+          int y = std::min(std::max(sy + k, 0), src_height - 1);
+          yofs[dy * 2 + k] = src_height - 1 - y;
+        }
+        beta[dy * 2 + 0] = saturate_short(std::lrint((1.f - fy) * coef_scale));
+        beta[dy * 2 + 1] = saturate_short(std::lrint(fy * coef_scale));
+      }
+
+      // OpenCV processes blocks of 16 and then blocks of 4 elements with
+      // SIMD and the remaining ones with scalar code. The two round
+      // differently, so remember where the scalar tail starts.
+      vector_end = row_width >= 16 ? row_width / 16 * 16 : 0;
+      while(vector_end < row_width - 4) vector_end += 4;
+    }
+
+    // Preprocess src (src_width x src_height x n_channels bytes) into dst
+    // (n_channels x dst_height x dst_width bytes). If preview is not null,
+    // it receives the resized image in interleaved layout with rows
+    // preview_step bytes apart.
+    void operator()(const uint8_t* src, uint8_t* dst, uint8_t* preview = nullptr, int preview_step = 0) {
+      const int plane = dst_height * dst_width;
+      for(int dy = 0; dy < dst_height; ++dy) {
+        resize_row(src, dy);
+        if(preview != nullptr) {
+          std::copy(row.begin(), row.end(), preview + dy * preview_step);
+        }
+        const uint8_t* r = row.data();
+        for(int c = 0; c < n_channels; ++c) {
+          uint8_t* out = dst + c * plane + dy * dst_width;
+          for(int dx = 0; dx < dst_width; ++dx) {
+            out[dx] = r[dx * n_channels + c];
+          }
+        }
+      }
+    }
+
+    // Preprocess src directly into the float input of a network. Every
+    // element of the planar output is transformed to (x - mean[i]) * scale
+    // which matches what caffe::DataTransformer computes for uint8 data.
+    template <class Dtype>
+    void operator()(const uint8_t* src, Dtype* dst, const Dtype* mean, Dtype scale, uint8_t* preview = nullptr, int preview_step = 0) {
+      const int plane = dst_height * dst_width;
+      for(int dy = 0; dy < dst_height; ++dy) {
+        resize_row(src, dy);
+        if(preview != nullptr) {
+          std::copy(row.begin(), row.end(), preview + dy * preview_step);
+        }
+        const uint8_t* r = row.data();
+        for(int c = 0; c < n_channels; ++c) {
+          const int offset = c * plane + dy * dst_width;
+          Dtype* out = dst + offset;
+          const Dtype* m = mean + offset;
+          for(int dx = 0; dx < dst_width; ++dx) {
+            out[dx] = ((Dtype)r[dx * n_channels + c] - m[dx]) * scale;
+          }
+        }
+      }
+    }
+
+  protected:
+    static short saturate_short(long v) {
+      return (short)std::min<long>(std::max<long>(v, -32768), 32767);
+    }
+
+    // resize the two source rows needed for output row dy into row
+    void resize_row(const uint8_t* src, int dy) {
+      const int* s[2];
+      for(int k = 0; k < 2; ++k) {
+        int y = yofs[dy * 2 + k];
+        if(cached_rows[k] != y) {
+          if(cached_rows[1 - k] == y) {
+            std::swap(rows[0], rows[1]);
+            std::swap(cached_rows[0], cached_rows[1]);
+          } else {
+            hresize(src + (size_t)y * src_width * n_channels, rows[k].data());
+            cached_rows[k] = y;
+          }
+        }
+        s[k] = rows[k].data();
+      }
+      vresize(s[0], s[1], beta[dy * 2 + 0], beta[dy * 2 + 1], row.data());
+    }
+
+    void hresize(const uint8_t* s, int* d) {
+      int x = 0;
+      for(; x < xmax; ++x) {
+        int sx = xofs[x];
+        d[x] = s[sx] * alpha[x * 2 + 0] + s[sx + n_channels] * alpha[x * 2 + 1];
+      }
+      for(; x < row_width; ++x) {
+        d[x] = s[xofs[x]] * coef_scale;
+      }
+    }
+
+    void vresize(const int* s0, const int* s1, short b0, short b1, uint8_t* d) {
+      int x = 0;
+#ifdef __SSE2__
+      const __m128i vb0 = _mm_set1_epi16(b0), vb1 = _mm_set1_epi16(b1);
+      const __m128i delta = _mm_set1_epi16(2);
+      for(; x + 16 <= vector_end; x += 16) {
+        __m128i x0 = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s0 + x)), 4),
+            _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s0 + x + 4)), 4));
+        __m128i y0 = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s1 + x)), 4),
+            _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s1 + x + 4)), 4));
+        __m128i x1 = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s0 + x + 8)), 4),
+            _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s0 + x + 12)), 4));
+        __m128i y1 = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s1 + x + 8)), 4),
+            _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s1 + x + 12)), 4));
+        x0 = _mm_adds_epi16(_mm_mulhi_epi16(x0, vb0), _mm_mulhi_epi16(y0, vb1));
+        x1 = _mm_adds_epi16(_mm_mulhi_epi16(x1, vb0), _mm_mulhi_epi16(y1, vb1));
+        x0 = _mm_srai_epi16(_mm_adds_epi16(x0, delta), 2);
+        x1 = _mm_srai_epi16(_mm_adds_epi16(x1, delta), 2);
+        _mm_storeu_si128((__m128i*)(d + x), _mm_packus_epi16(x0, x1));
+      }
+#endif
+      // remaining SIMD blocks (or all of them without SSE2) in scalar code
+      // with the same rounding
+      for(; x < vector_end; ++x) {
+        int a = saturate_short(s0[x] >> 4),
+            b = saturate_short(s1[x] >> 4);
+        int v = saturate_short(((a * b0) >> 16) + ((b * b1) >> 16));
+        v = saturate_short(v + 2) >> 2;
+        d[x] = (uint8_t)std::min(std::max(v, 0), 255);
+      }
+      // scalar tail
+      const int shift = 2 * coef_bits;
+      for(; x < row_width; ++x) {
+        int v = (s0[x] * b0 + s1[x] * b1 + (1 << (shift - 1))) >> shift;
+        d[x] = (uint8_t)std::min(std::max(v, 0), 255);
+      }
+    }
+
+    const int src_width, src_height;
+    const int dst_width, dst_height;
+    const int n_channels;
+    const int row_width;
+    int xmax;
+    int vector_end;
+
+    std::vector<int> xofs;
+    std::vector<short> alpha;
+    std::vector<int> yofs;
+    std::vector<short> beta;
+
+    // horizontally resized source rows and their index in memory
+    std::vector<int> rows[2];
+    int cached_rows[2];
+    // vertically resized, interleaved output row
+    std::vector<uint8_t> row;
+};
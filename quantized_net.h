@@ -0,0 +1,530 @@
+#pragma once
+
+#include <glog/logging.h>
+
+#include <caffe/caffe.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUANTIZED_NET_X86
+#endif
+
+
+// layers of network_deploy.prototxt computed in int8, the output layer fc9
+// stays in float
+const std::string default_quantized_layers = "conv1,conv2,conv3,conv4,conv5,fc6,fc7,fc8";
+
+
+// dot product of two int8 vectors accumulated in int32
+inline int32_t dot_int8(const int8_t* a, const int8_t* b, int n)
+{
+  int i = 0;
+  int32_t result = 0;
+#ifdef __SSE2__
+  __m128i sum = _mm_setzero_si128();
+#ifdef __AVX2__
+  __m256i sum256 = _mm256_setzero_si256();
+  for(; i + 32 <= n; i += 32) {
+    __m256i a_lo = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+    __m256i b_lo = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+    __m256i a_hi = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i + 16)));
+    __m256i b_hi = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i + 16)));
+    sum256 = _mm256_add_epi32(sum256, _mm256_madd_epi16(a_lo, b_lo));
+    sum256 = _mm256_add_epi32(sum256, _mm256_madd_epi16(a_hi, b_hi));
+  }
+  sum = _mm_add_epi32(_mm256_castsi256_si128(sum256), _mm256_extracti128_si256(sum256, 1));
+#endif
+  for(; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    // sign extend to 16 bit by unpacking into the high byte and shifting
+    __m128i a_lo = _mm_srai_epi16(_mm_unpacklo_epi8(va, va), 8);
+    __m128i a_hi = _mm_srai_epi16(_mm_unpackhi_epi8(va, va), 8);
+    __m128i b_lo = _mm_srai_epi16(_mm_unpacklo_epi8(vb, vb), 8);
+    __m128i b_hi = _mm_srai_epi16(_mm_unpackhi_epi8(vb, vb), 8);
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(a_lo, b_lo));
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(a_hi, b_hi));
+  }
+  int32_t lanes[4];
+  _mm_storeu_si128((__m128i*)lanes, sum);
+  result = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for(; i < n; ++i) {
+    result += (int32_t)a[i] * (int32_t)b[i];
+  }
+  return result;
+}
+
+// Dot products of four rows a[i] with two rows b[j] of n int16, n a multiple
+// of 16, into sums[2 * i + j]. Each row of b is loaded once for all rows of
+// a and vice versa, which makes this the inner kernel of the convolutions.
+typedef void (*DotInt16Kernel)(const int16_t* const* a, const int16_t* const* b, int n, int32_t* sums);
+
+inline void dot_int16_4x2_generic(const int16_t* const* a, const int16_t* const* b, int n, int32_t* sums)
+{
+  for(int i = 0; i < 4; ++i) {
+    for(int j = 0; j < 2; ++j) {
+      int32_t sum = 0;
+      for(int k = 0; k < n; ++k) {
+        sum += (int32_t)a[i][k] * b[j][k];
+      }
+      sums[2 * i + j] = sum;
+    }
+  }
+}
+
+#ifdef __SSE2__
+inline int32_t horizontal_sum(__m128i x)
+{
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(x);
+}
+
+inline void dot_int16_4x2_sse2(const int16_t* const* a, const int16_t* const* b, int n, int32_t* sums)
+{
+  __m128i s[8];
+  for(int i = 0; i < 8; ++i) s[i] = _mm_setzero_si128();
+  for(int k = 0; k < n; k += 8) {
+    __m128i b0 = _mm_loadu_si128((const __m128i*)(b[0] + k));
+    __m128i b1 = _mm_loadu_si128((const __m128i*)(b[1] + k));
+    for(int i = 0; i < 4; ++i) {
+      __m128i ai = _mm_loadu_si128((const __m128i*)(a[i] + k));
+      s[2 * i] = _mm_add_epi32(s[2 * i], _mm_madd_epi16(ai, b0));
+      s[2 * i + 1] = _mm_add_epi32(s[2 * i + 1], _mm_madd_epi16(ai, b1));
+    }
+  }
+  for(int i = 0; i < 8; ++i) sums[i] = horizontal_sum(s[i]);
+}
+#endif
+
+#ifdef QUANTIZED_NET_X86
+__attribute__((target("avx2")))
+inline void dot_int16_4x2_avx2(const int16_t* const* a, const int16_t* const* b, int n, int32_t* sums)
+{
+  __m256i s[8];
+  for(int i = 0; i < 8; ++i) s[i] = _mm256_setzero_si256();
+  for(int k = 0; k < n; k += 16) {
+    __m256i b0 = _mm256_loadu_si256((const __m256i*)(b[0] + k));
+    __m256i b1 = _mm256_loadu_si256((const __m256i*)(b[1] + k));
+    for(int i = 0; i < 4; ++i) {
+      __m256i ai = _mm256_loadu_si256((const __m256i*)(a[i] + k));
+      s[2 * i] = _mm256_add_epi32(s[2 * i], _mm256_madd_epi16(ai, b0));
+      s[2 * i + 1] = _mm256_add_epi32(s[2 * i + 1], _mm256_madd_epi16(ai, b1));
+    }
+  }
+  for(int i = 0; i < 8; ++i) {
+    __m128i x = _mm_add_epi32(_mm256_castsi256_si128(s[i]), _mm256_extracti128_si256(s[i], 1));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+    sums[i] = _mm_cvtsi128_si32(x);
+  }
+}
+#endif
+
+// fastest variant of the kernel supported by the CPU
+inline DotInt16Kernel select_dot_int16_kernel()
+{
+#ifdef QUANTIZED_NET_X86
+  if(__builtin_cpu_supports("avx2")) return dot_int16_4x2_avx2;
+#endif
+#ifdef __SSE2__
+  return dot_int16_4x2_sse2;
+#else
+  return dot_int16_4x2_generic;
+#endif
+}
+
+// symmetric quantization of x with 1 / scale
+inline int8_t quantize_int8(float x, float inv_scale)
+{
+  return (int8_t)std::max(-127L, std::min(127L, std::lrint(x * inv_scale)));
+}
+
+
+// Threads running the tasks of run() together with the calling thread.
+class WorkerPool {
+  public:
+    // n_threads including the calling thread, 0 for the number of cores
+    explicit WorkerPool(int n_threads) : job(nullptr), n_tasks(0), next(0), busy(0), generation(0), stopped(false) {
+      if(n_threads <= 0) n_threads = std::max(1u, std::thread::hardware_concurrency());
+      for(int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(&WorkerPool::work_loop, this);
+      }
+    }
+
+    ~WorkerPool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+      }
+      start.notify_all();
+      for(auto& worker : workers) {
+        worker.join();
+      }
+    }
+
+    int size() const { return workers.size() + 1; }
+
+    // call f(task) for every task in [0, n) and wait until all are done
+    void run(int n, const std::function<void(int)>& f) {
+      if(workers.empty() || n <= 1) {
+        for(int task = 0; task < n; ++task) f(task);
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &f;
+        n_tasks = n;
+        next = 0;
+        busy = workers.size();
+        generation += 1;
+      }
+      start.notify_all();
+      work();
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [this]() { return busy == 0; });
+      job = nullptr;
+    }
+
+  protected:
+    void work() {
+      for(int task = next++; task < n_tasks; task = next++) {
+        (*job)(task);
+      }
+    }
+
+    void work_loop() {
+      unsigned int seen = 0;
+      while(true) {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          start.wait(lock, [&]() { return stopped || generation != seen; });
+          if(stopped) return;
+          seen = generation;
+        }
+        work();
+        std::lock_guard<std::mutex> lock(mutex);
+        if(--busy == 0) done.notify_one();
+      }
+    }
+
+    std::vector<std::thread> workers;
+    const std::function<void(int)>* job;
+    int n_tasks;
+    std::atomic<int> next;
+    size_t busy;
+    unsigned int generation;
+    bool stopped;
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+};
+
+
+// Int8 inference of a caffe::Net<float> on the CPU. The Convolution and
+// InnerProduct layers given by name are computed with int8 weights (one
+// symmetric scale per output channel) and int8 inputs (one symmetric scale
+// per layer, calibrated on sample inputs) accumulated in int32. All other
+// layers run in caffe as usual and the net can still be run in float with
+// Net::Forward().
+//
+// Convolutions are computed as a blocked matrix product of the weights with
+// the receptive fields of all output positions, both widened to int16 for
+// SIMD multiply-adds. Blocks of outputs and positions, the gathering of the
+// receptive fields and the outputs of InnerProduct layers are distributed
+// over n_threads threads (0 for the number of cores).
+//
+// Calibration: set the input of the net to a sample and call observe(),
+// repeat for a representative set of samples. The calibration can be saved
+// and loaded again instead.
+class QuantizedNet {
+  public:
+    QuantizedNet(caffe::Net<float>& net, const std::vector<std::string>& layer_names, int n_threads = 0)
+      : net(net), n_observed(0), pool(n_threads), dot_int16_4x2(select_dot_int16_kernel())
+    {
+      for(const auto& name : layer_names) {
+        auto position = std::find(net.layer_names().begin(), net.layer_names().end(), name);
+        CHECK(position != net.layer_names().end()) << "Unknown layer " << name;
+        layers.push_back(quantize_layer(position - net.layer_names().begin()));
+      }
+      std::sort(layers.begin(), layers.end(), [](const Layer& a, const Layer& b) { return a.index < b.index; });
+      input_max.assign(layers.size(), 0);
+      input_scales.assign(layers.size(), 0);
+    }
+
+    // run the net in float on its current input and record the range of
+    // the inputs of quantized layers
+    void observe() {
+      unsigned int next = 0;
+      for(unsigned int i = 0; i < net.layers().size(); ++i) {
+        if(next < layers.size() && layers[next].index == (int)i) {
+          const caffe::Blob<float>* bottom = net.bottom_vecs()[i][0];
+          const float* data = bottom->cpu_data();
+          for(int j = 0; j < bottom->count(); ++j) {
+            input_max[next] = std::max(input_max[next], std::abs(data[j]));
+          }
+          input_scales[next] = input_max[next] > 0 ? input_max[next] / 127 : 1;
+          next += 1;
+        }
+        net.ForwardFromTo(i, i);
+      }
+      n_observed += 1;
+    }
+
+    // the calibration is stored as a NetParameter with a layer of the name
+    // of every quantized layer holding its input scale in a blob
+    void save_calibration(const std::string& fname) const {
+      CHECK(calibrated()) << "Nothing to save, no samples were observed.";
+      caffe::NetParameter proto;
+      for(unsigned int i = 0; i < layers.size(); ++i) {
+        caffe::LayerParameter* layer = proto.add_layer();
+        layer->set_name(net.layer_names()[layers[i].index]);
+        caffe::BlobProto* scale = layer->add_blobs();
+        scale->mutable_shape()->add_dim(1);
+        scale->add_data(input_scales[i]);
+      }
+      caffe::WriteProtoToBinaryFile(proto, fname);
+    }
+
+    void load_calibration(const std::string& fname) {
+      caffe::NetParameter proto;
+      caffe::ReadProtoFromBinaryFileOrDie(fname, &proto);
+      CHECK(proto.layer_size() == (int)layers.size()) << "Calibration in " << fname << " is for " << proto.layer_size()
+        << " layers but " << layers.size() << " layers are quantized.";
+      input_scales.resize(layers.size());
+      for(unsigned int i = 0; i < layers.size(); ++i) {
+        const caffe::LayerParameter& layer = proto.layer(i);
+        const std::string& name = net.layer_names()[layers[i].index];
+        CHECK(layer.name() == name) << "Calibration in " << fname << " is for layer " << layer.name() << " instead of "
+          << name << ", calibrate again for the quantized layers.";
+        CHECK(layer.blobs_size() == 1 && layer.blobs(0).data_size() == 1) << "Invalid calibration of layer " << name
+          << " in " << fname;
+        input_scales[i] = layer.blobs(0).data(0);
+      }
+      n_observed = 1;
+    }
+
+    bool calibrated() const { return n_observed > 0; }
+
+    // run the net on its current input with the quantized layers in int8
+    void Forward() {
+      CHECK(calibrated()) << "Quantized net must be calibrated first.";
+      CHECK(caffe::Caffe::mode() == caffe::Caffe::CPU) << "Quantized inference runs on the CPU only.";
+      unsigned int next = 0;
+      for(unsigned int i = 0; i < net.layers().size(); ++i) {
+        if(next < layers.size() && layers[next].index == (int)i) {
+          forward_layer(layers[next], input_scales[next]);
+          next += 1;
+        } else {
+          net.ForwardFromTo(i, i);
+        }
+      }
+    }
+
+  protected:
+    // inputs are quantized in blocks of this size, padded with zeros
+    static const int block = 32;
+    // outputs and positions of the tasks of a convolution, such that the
+    // weights of the outputs stay in cache while the positions are visited
+    static const int output_block = 32, position_block = 64;
+    // outputs of the tasks of an InnerProduct layer
+    static const int inner_product_block = 64;
+
+    struct Layer {
+      int index;
+      bool convolution;
+      int kernel, stride, pad, group;
+      // weights of each output in a row of padded_size, widened to int16
+      // for convolutions
+      int n_outputs, size, padded_size;
+      std::vector<int8_t> weights;
+      std::vector<int16_t> wide_weights;
+      std::vector<float> weight_scales;
+      std::vector<float> bias;
+    };
+
+    static int padded(int size) {
+      return (size + block - 1) / block * block;
+    }
+
+    Layer quantize_layer(int index) {
+      auto layer = net.layers()[index];
+      const std::string& name = net.layer_names()[index];
+      Layer q;
+      q.index = index;
+      q.convolution = std::string(layer->type()) == "Convolution";
+      CHECK(q.convolution || std::string(layer->type()) == "InnerProduct") <<
+        "Only Convolution and InnerProduct layers can be quantized, " << name << " is a " << layer->type() << " layer.";
+      if(q.convolution) {
+        const auto& param = layer->layer_param().convolution_param();
+        CHECK(param.kernel_size_size() == 1 && param.stride_size() <= 1 && param.pad_size() <= 1 && param.dilation_size() == 0) <<
+          "Only square kernels with uniform stride and padding are supported, see " << name;
+        q.kernel = param.kernel_size(0);
+        q.stride = param.stride_size() > 0 ? param.stride(0) : 1;
+        q.pad = param.pad_size() > 0 ? param.pad(0) : 0;
+        q.group = param.group();
+      } else {
+        CHECK(!layer->layer_param().inner_product_param().transpose()) << "Transposed weights are not supported, see " << name;
+        q.kernel = q.stride = q.group = 1;
+        q.pad = 0;
+      }
+
+      // weights are (outputs, inputs) for InnerProduct and (outputs,
+      // channels / group, kernel, kernel) for Convolution layers, i.e. the
+      // weights of an output are contiguous in both cases
+      const caffe::Blob<float>* weights = layer->blobs()[0].get();
+      q.n_outputs = weights->shape(0);
+      q.size = weights->count(1);
+      q.padded_size = padded(q.size);
+      q.weights.assign(q.n_outputs * q.padded_size, 0);
+      q.weight_scales.resize(q.n_outputs);
+      for(int o = 0; o < q.n_outputs; ++o) {
+        const float* row = weights->cpu_data() + o * q.size;
+        float max = 0;
+        for(int k = 0; k < q.size; ++k) {
+          max = std::max(max, std::abs(row[k]));
+        }
+        q.weight_scales[o] = max > 0 ? max / 127 : 1;
+        for(int k = 0; k < q.size; ++k) {
+          q.weights[o * q.padded_size + k] = quantize_int8(row[k], 1 / q.weight_scales[o]);
+        }
+      }
+      if(q.convolution) {
+        q.wide_weights.assign(q.weights.begin(), q.weights.end());
+        q.weights.clear();
+      }
+      q.bias.assign(q.n_outputs, 0);
+      if(layer->blobs().size() > 1) {
+        std::copy(layer->blobs()[1]->cpu_data(), layer->blobs()[1]->cpu_data() + q.n_outputs, q.bias.begin());
+      }
+      return q;
+    }
+
+    void forward_layer(const Layer& q, float input_scale) {
+      const caffe::Blob<float>* bottom = net.bottom_vecs()[q.index][0];
+      caffe::Blob<float>* top = net.top_vecs()[q.index][0];
+      const int num = bottom->shape(0);
+      const int input_size = bottom->count(1);
+      const float inv_scale = 1 / input_scale;
+      // scale from the int32 accumulator to the float output
+      output_scales.resize(q.n_outputs);
+      for(int o = 0; o < q.n_outputs; ++o) {
+        output_scales[o] = input_scale * q.weight_scales[o];
+      }
+
+      for(int n = 0; n < num; ++n) {
+        const float* input = bottom->cpu_data() + n * input_size;
+        float* output = top->mutable_cpu_data() + n * top->count(1);
+
+        if(!q.convolution) {
+          quantized_input.assign(q.padded_size, 0);
+          for(int k = 0; k < input_size; ++k) {
+            quantized_input[k] = quantize_int8(input[k], inv_scale);
+          }
+          const int n_tasks = (q.n_outputs + inner_product_block - 1) / inner_product_block;
+          pool.run(n_tasks, [&](int task) {
+            const int o_end = std::min((task + 1) * inner_product_block, q.n_outputs);
+            for(int o = task * inner_product_block; o < o_end; ++o) {
+              int32_t sum = dot_int8(&q.weights[o * q.padded_size], quantized_input.data(), q.padded_size);
+              output[o] = sum * output_scales[o] + q.bias[o];
+            }
+          });
+          continue;
+        }
+
+        const int channels = bottom->shape(1), height = bottom->shape(2), width = bottom->shape(3);
+        const int out_height = top->shape(2), out_width = top->shape(3);
+        const int n_positions = out_height * out_width;
+        const int group_channels = channels / q.group, group_outputs = q.n_outputs / q.group;
+        wide_input.resize(input_size);
+        pool.run(channels, [&](int c) {
+          for(int k = c * height * width; k < (c + 1) * height * width; ++k) {
+            wide_input[k] = quantize_int8(input[k], inv_scale);
+          }
+        });
+
+        for(int g = 0; g < q.group; ++g) {
+          // gather the receptive field of every output position into a
+          // contiguous row, zero outside of the input as padding
+          patches.assign(n_positions * q.padded_size, 0);
+          pool.run(out_height, [&](int oh) {
+            for(int ow = 0; ow < out_width; ++ow) {
+              int16_t* patch = &patches[(oh * out_width + ow) * q.padded_size];
+              for(int c = 0; c < group_channels; ++c) {
+                const int16_t* channel = &wide_input[(g * group_channels + c) * height * width];
+                for(int kh = 0; kh < q.kernel; ++kh) {
+                  int h = oh * q.stride - q.pad + kh;
+                  if(h < 0 || h >= height) continue;
+                  for(int kw = 0; kw < q.kernel; ++kw) {
+                    int w = ow * q.stride - q.pad + kw;
+                    if(w < 0 || w >= width) continue;
+                    patch[(c * q.kernel + kh) * q.kernel + kw] = channel[h * width + w];
+                  }
+                }
+              }
+            }
+          });
+
+          // blocked product of the weights of the outputs of the group with
+          // the patches, in tiles of 4 outputs and 2 positions. Rows past
+          // the end of a block are computed again and their sums discarded.
+          const int n_output_blocks = (group_outputs + output_block - 1) / output_block;
+          const int n_position_blocks = (n_positions + position_block - 1) / position_block;
+          pool.run(n_output_blocks * n_position_blocks, [&](int task) {
+            const int o_begin = g * group_outputs + task % n_output_blocks * output_block;
+            const int o_end = std::min(o_begin + output_block, (g + 1) * group_outputs);
+            const int p_begin = task / n_output_blocks * position_block;
+            const int p_end = std::min(p_begin + position_block, n_positions);
+            const int16_t* a[4];
+            const int16_t* b[2];
+            int32_t sums[8];
+            for(int p = p_begin; p < p_end; p += 2) {
+              for(int j = 0; j < 2; ++j) {
+                b[j] = &patches[std::min(p + j, p_end - 1) * q.padded_size];
+              }
+              for(int o = o_begin; o < o_end; o += 4) {
+                for(int i = 0; i < 4; ++i) {
+                  a[i] = &q.wide_weights[std::min(o + i, o_end - 1) * q.padded_size];
+                }
+                dot_int16_4x2(a, b, q.padded_size, sums);
+                for(int i = 0; i < 4 && o + i < o_end; ++i) {
+                  for(int j = 0; j < 2 && p + j < p_end; ++j) {
+                    output[(o + i) * n_positions + p + j] = sums[2 * i + j] * output_scales[o + i] + q.bias[o + i];
+                  }
+                }
+              }
+            }
+          });
+        }
+      }
+    }
+
+    caffe::Net<float>& net;
+    std::vector<Layer> layers;
+    // calibration
+    int n_observed;
+    std::vector<float> input_max;
+    std::vector<float> input_scales;
+    WorkerPool pool;
+    DotInt16Kernel dot_int16_4x2;
+    // buffers
+    std::vector<float> output_scales;
+    std::vector<int8_t> quantized_input;
+    std::vector<int16_t> wide_input;
+    std::vector<int16_t> patches;
+};
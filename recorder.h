@@ -0,0 +1,186 @@
+#pragma once
+
+#include "utils.h"
+#include "torcs_shm.h"
+#include "datum_codec.h"
+#include "device.h"
+
+#include <leveldb/write_batch.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// number of regression targets, the steering command is the last one
+const int n_targets = 15;
+
+// Regression targets of a frame in the order of the training data: the
+// affordances of the ground truth followed by the steering command.
+inline std::vector<float> targets_from_ground_truth(const GroundTruth& gt, const Commands& commands)
+{
+  return {(float)gt.angle,
+          (float)gt.toMarking_L, (float)gt.toMarking_M, (float)gt.toMarking_R,
+          (float)gt.dist_L, (float)gt.dist_R,
+          (float)gt.toMarking_LL, (float)gt.toMarking_ML, (float)gt.toMarking_MR, (float)gt.toMarking_RR,
+          (float)gt.dist_LL, (float)gt.dist_MM, (float)gt.dist_RR,
+          (float)gt.fast,
+          (float)commands.steer};
+}
+
+
+// Record frames and their regression targets into the leveldbs
+// prefix_input and prefix_target in the format produced by split.cpp.
+// Frames are queued, encoded if encoding is enabled and written in batches
+// by a background thread. If the writer falls behind by more than max_queue
+// frames, further frames are dropped instead of blocking the caller.
+class SessionRecorder {
+  public:
+    SessionRecorder(const std::string& prefix, int channels, int height, int width, int max_queue, int batch_size,
+                    const FrameEncoding& encoding = FrameEncoding())
+      : channels(channels), height(height), width(width), max_queue(max_queue), batch_size(batch_size), encoding(encoding),
+        count(0), dropped(0), stopped(false)
+    {
+      leveldb::Options options;
+      options.error_if_exists = true;
+      options.create_if_missing = true;
+      options.max_open_files = 100;
+      input_db = open_leveldb(prefix + "_input", options);
+      target_db = open_leveldb(prefix + "_target", options);
+      writer = std::thread(&SessionRecorder::write_loop, this);
+    }
+
+    ~SessionRecorder() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+      }
+      condition.notify_one();
+      writer.join();
+      delete input_db;
+      delete target_db;
+      LOG(INFO) << "Recorded " << count << " frames, dropped " << dropped << ".";
+    }
+
+    // queue an image in interleaved (height, width, channel) layout
+    // together with its targets, returns false if it was dropped
+    bool record(const uint8_t* image, const std::vector<float>& targets) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if((int)queue.size() >= max_queue) {
+        dropped += 1;
+        return false;
+      }
+      Item item;
+      if(!free_items.empty()) {
+        item = std::move(free_items.back());
+        free_items.pop_back();
+      }
+      item.image.assign(image, image + channels * height * width);
+      item.targets = targets;
+      queue.push_back(std::move(item));
+      lock.unlock();
+      condition.notify_one();
+      return true;
+    }
+
+  protected:
+    struct Item {
+      std::vector<uint8_t> image;
+      std::vector<float> targets;
+    };
+
+    void write_loop() {
+      // writing must not preempt the control loop under --realtime. The
+      // compaction thread leveldb starts from here inherits this as well.
+      set_normal_priority();
+      caffe::Datum input_datum;
+      input_datum.set_channels(channels);
+      input_datum.set_height(height);
+      input_datum.set_width(width);
+      input_datum.mutable_data()->resize(channels * height * width);
+      caffe::Datum target_datum;
+      target_datum.set_channels(1);
+      target_datum.set_height(1);
+
+      leveldb::WriteBatch input_batch, target_batch;
+      leveldb::WriteOptions write_options;
+      std::string serialized_datum;
+      int batched = 0;
+      std::vector<Item> items;
+      while(true) {
+        bool stopping;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          condition.wait(lock, [this]() { return stopped || !queue.empty(); });
+          stopping = stopped;
+          while(!queue.empty()) {
+            items.push_back(std::move(queue.front()));
+            queue.pop_front();
+          }
+        }
+
+        for(auto& item : items) {
+          if(encoding.enabled()) {
+            encode_frame(encoding, item.image.data(), channels, height, width, &input_datum);
+          } else {
+            // interleaved to planar layout
+            std::string* data = input_datum.mutable_data();
+            for(int h = 0; h < height; ++h) {
+              for(int w = 0; w < width; ++w) {
+                for(int c = 0; c < channels; ++c) {
+                  (*data)[(c * height + h) * width + w] = (char)item.image[(h * width + w) * channels + c];
+                }
+              }
+            }
+          }
+          target_datum.set_width(item.targets.size());
+          target_datum.clear_float_data();
+          for(float target : item.targets) {
+            target_datum.add_float_data(target);
+          }
+
+          std::string key = key_from_int(count);
+          input_datum.SerializeToString(&serialized_datum);
+          input_batch.Put(key, serialized_datum);
+          target_datum.SerializeToString(&serialized_datum);
+          target_batch.Put(key, serialized_datum);
+          count += 1;
+          batched += 1;
+        }
+
+        if(batched >= batch_size || (stopping && batched > 0)) {
+          CHECK(input_db->Write(write_options, &input_batch).ok()) << "Failed to write recorded frames.";
+          CHECK(target_db->Write(write_options, &target_batch).ok()) << "Failed to write recorded targets.";
+          input_batch.Clear();
+          target_batch.Clear();
+          batched = 0;
+        }
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          for(auto& item : items) {
+            free_items.push_back(std::move(item));
+          }
+        }
+        items.clear();
+        if(stopping) break;
+      }
+    }
+
+    int channels, height, width;
+    int max_queue, batch_size;
+    FrameEncoding encoding;
+    leveldb::DB* input_db;
+    leveldb::DB* target_db;
+    // written frames, only accessed by the writer
+    int count;
+    int dropped;
+    bool stopped;
+    std::deque<Item> queue;
+    std::vector<Item> free_items;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread writer;
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "stats.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+
+// Keep the time from acquiring a frame to answering it within a deadline.
+// Before a frame is predicted, the scheduler estimates from the recent
+// duration of the forward pass whether its prediction would be late. Late
+// frames are handled according to the policy:
+//
+// latest: drop the frame without answering it if a newer frame of the car
+//   is available already, predict it anyway otherwise
+// hold: answer right away with the last predicted steering command of the
+//   car
+// extrapolate: answer right away with the steering command extrapolated
+//   linearly from the last two predictions of the car
+//
+// After max_fallbacks consecutive held or extrapolated frames of a car, its
+// next frame is predicted regardless, so that the estimate of the forward
+// pass is updated and the car does not drive on old commands indefinitely.
+//
+// Answers sent after the deadline count as misses. All methods must be
+// called from the same thread.
+class DeadlineScheduler {
+  public:
+    enum Policy { latest, hold, extrapolate };
+
+    // deadline_us <= 0 disables the scheduler
+    DeadlineScheduler(int n_cars, long deadline_us, const std::string& policy_name, int max_fallbacks, LatencyStats& stats)
+      : deadline(std::chrono::microseconds(deadline_us)), enabled_(deadline_us > 0), max_fallbacks(max_fallbacks),
+        cars(n_cars), expected_forward_ns(0),
+        missed(stats.add_counter("missed")), dropped(stats.add_counter("dropped")),
+        held(stats.add_counter("held")), extrapolated(stats.add_counter("extrapolated"))
+    {
+      if(policy_name == "latest") {
+        policy_ = latest;
+      } else if(policy_name == "hold") {
+        policy_ = hold;
+      } else if(policy_name == "extrapolate") {
+        policy_ = extrapolate;
+      } else {
+        LOG(FATAL) << "Unknown deadline policy: " << policy_name;
+      }
+    }
+
+    bool enabled() const { return enabled_; }
+    Policy policy() const { return policy_; }
+
+    // whether the prediction of a frame acquired at acquired is expected to
+    // be answered after its deadline if the forward pass starts now
+    bool late(std::chrono::steady_clock::time_point acquired) const {
+      if(!enabled_) return false;
+      auto expected = std::chrono::steady_clock::now() + std::chrono::nanoseconds((long long)expected_forward_ns);
+      return expected > acquired + deadline;
+    }
+
+    // steering command to answer a late frame of car with instead of a
+    // prediction, returns false if the car has no predictions yet or its
+    // frame has to be predicted after max_fallbacks fallbacks. Fallbacks
+    // only depend on predictions, never on earlier fallbacks.
+    bool fallback(int car, float* steer) {
+      Car& c = cars[car];
+      if(c.n_predicted == 0 || (int)c.fallbacks >= max_fallbacks) return false;
+      c.fallbacks += 1;
+      *steer = c.steer[1];
+      if(policy_ == extrapolate && c.n_predicted > 1) {
+        double interval = std::chrono::duration<double>(c.predicted[1] - c.predicted[0]).count();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - c.predicted[1]).count();
+        // extrapolate at most one interval beyond the last prediction
+        double t = interval > 0 ? std::min(elapsed / interval, 1.) : 0;
+        *steer = std::max(-1.f, std::min(1.f, (float)(c.steer[1] + t * (c.steer[1] - c.steer[0]))));
+        extrapolated.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        held.fetch_add(1, std::memory_order_relaxed);
+      }
+      return true;
+    }
+
+    // count a late frame that was dropped
+    void drop() {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // record the duration of a forward pass
+    void forward_took(std::chrono::steady_clock::duration duration) {
+      double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+      expected_forward_ns = expected_forward_ns == 0 ? ns : 0.9 * expected_forward_ns + 0.1 * ns;
+    }
+
+    // record that a frame of car acquired at acquired was answered with
+    // steer just now, predicted unless steer is a fallback
+    void answered(int car, float steer, std::chrono::steady_clock::time_point acquired, bool predicted) {
+      auto now = std::chrono::steady_clock::now();
+      Car& c = cars[car];
+      if(predicted) {
+        c.fallbacks = 0;
+        c.steer[0] = c.steer[1];
+        c.predicted[0] = c.predicted[1];
+        c.steer[1] = steer;
+        c.predicted[1] = now;
+        c.n_predicted += 1;
+      }
+      if(enabled_ && now > acquired + deadline) {
+        missed.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+  protected:
+    // the last two predicted commands of a car and when they were sent,
+    // the latest one at index 1
+    struct Car {
+      Car() : n_predicted(0), fallbacks(0), steer{0, 0} {}
+      unsigned int n_predicted;
+      // number of fallbacks since the last prediction
+      unsigned int fallbacks;
+      float steer[2];
+      std::chrono::steady_clock::time_point predicted[2];
+    };
+
+    std::chrono::steady_clock::duration deadline;
+    bool enabled_;
+    Policy policy_;
+    int max_fallbacks;
+    std::vector<Car> cars;
+    // moving average of the duration of the forward pass
+    double expected_forward_ns;
+    std::atomic<uint64_t>& missed;
+    std::atomic<uint64_t>& dropped;
+    std::atomic<uint64_t>& held;
+    std::atomic<uint64_t>& extrapolated;
+};
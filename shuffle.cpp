@@ -1,8 +1,23 @@
 #include "utils.h"
+#include "manifest.h"
 
+#include <gflags/gflags.h>
+#include <leveldb/write_batch.h>
+
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <random>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+DEFINE_int64(seed, -1, "Seed of the shuffle. Negative to use a random seed.");
+DEFINE_int32(memory_mb, 2048, "Maximum size in MB of the records shuffled in memory at once.");
+DEFINE_int32(buckets, 0, "Number of buckets the records are scattered into. 0 to derive it from the size of the dbs and --memory_mb.");
+DEFINE_string(tmp_dir, "", "Directory for the buckets, created and removed again. Empty to use <db1>_shuffle_tmp.");
+DEFINE_int32(batch_size, 100, "Number of entries written to the output dbs at once.");
+
 void check_same_state(const std::vector<leveldb::Iterator*>& its) {
   for(unsigned int i = 1; i < its.size(); ++i) {
     CHECK(its[0]->Valid() == its[i]->Valid()) << "Inconsistent state of Iterators!";
@@ -10,16 +25,173 @@ void check_same_state(const std::vector<leveldb::Iterator*>& its) {
 }
 
 
-// Shuffle databases in lockstep
+// A record holds the values of all dbs for one key, each as its length
+// followed by its bytes. Buckets are files of records, each preceded by its
+// length.
+void append_value(const leveldb::Slice& value, std::string* record) {
+  uint32_t size = value.size();
+  record->append((const char*)&size, sizeof(size));
+  record->append(value.data(), value.size());
+}
+
+void write_record(FILE* bucket, const std::string& record) {
+  uint32_t size = record.size();
+  CHECK(fwrite(&size, sizeof(size), 1, bucket) == 1 && fwrite(record.data(), 1, size, bucket) == size) <<
+    "Could not write to bucket.";
+}
+
+bool read_record(FILE* bucket, std::string* record) {
+  uint32_t size;
+  if(fread(&size, sizeof(size), 1, bucket) != 1) return false;
+  record->resize(size);
+  CHECK(fread(&(*record)[0], 1, size, bucket) == size) << "Truncated bucket.";
+  return true;
+}
+
+long file_size(const std::string& fname) {
+  struct stat info;
+  CHECK(stat(fname.c_str(), &info) == 0) << "Can not stat " << fname;
+  return info.st_size;
+}
+
+
+// Scatter records into files prefix_0, prefix_1, ... chosen uniformly at
+// random. Shuffling every bucket and concatenating them yields a uniformly
+// random permutation of all records.
+class Buckets {
+  public:
+    Buckets(const std::string& prefix, int n_buckets, std::mt19937_64& random_engine)
+      : random_engine(random_engine), choose(0, n_buckets - 1)
+    {
+      for(int i = 0; i < n_buckets; ++i) {
+        fnames.push_back(prefix + "_" + std::to_string(i));
+        files.push_back(fopen(fnames.back().c_str(), "wb"));
+        CHECK(files.back() != nullptr) << "Could not create bucket " << fnames.back();
+      }
+    }
+
+    void add(const std::string& record) {
+      write_record(files[choose(random_engine)], record);
+    }
+
+    // close all buckets and return their file names
+    std::vector<std::string> close() {
+      for(auto file : files) {
+        CHECK(fclose(file) == 0) << "Could not write to bucket.";
+      }
+      files.clear();
+      return fnames;
+    }
+
+  protected:
+    std::mt19937_64& random_engine;
+    std::uniform_int_distribution<int> choose;
+    std::vector<std::string> fnames;
+    std::vector<FILE*> files;
+};
+
+
+// Write records to the output dbs under the original keys in their order,
+// in batches of batch_size.
+class ShuffledWriter {
+  public:
+    ShuffledWriter(const std::vector<leveldb::DB*>& dbs, const std::vector<std::string>& keys, int batch_size)
+      : dbs(dbs), batches(dbs.size()), keys(keys), batch_size(batch_size), count(0), in_batch(0) {}
+
+    void write(const std::string& record) {
+      CHECK(count < keys.size()) << "More records than keys.";
+      size_t offset = 0;
+      for(unsigned int db = 0; db < dbs.size(); ++db) {
+        uint32_t size;
+        memcpy(&size, record.data() + offset, sizeof(size));
+        offset += sizeof(size);
+        batches[db].Put(keys[count], leveldb::Slice(record.data() + offset, size));
+        offset += size;
+      }
+      count += 1;
+      in_batch += 1;
+      if(in_batch >= batch_size) flush();
+      if(count % 5000 == 0) {
+        std::cout << "Shuffled " << count << " entries." << std::endl;
+      }
+    }
+
+    void flush() {
+      for(unsigned int db = 0; db < dbs.size(); ++db) {
+        auto s = dbs[db]->Write(leveldb::WriteOptions(), &batches[db]);
+        CHECK(s.ok()) << s.ToString();
+        batches[db].Clear();
+      }
+      in_batch = 0;
+    }
+
+    size_t written() const { return count; }
+
+  protected:
+    std::vector<leveldb::DB*> dbs;
+    std::vector<leveldb::WriteBatch> batches;
+    const std::vector<std::string>& keys;
+    int batch_size;
+    size_t count;
+    int in_batch;
+};
+
+
+// Shuffle the records of a bucket in memory and write them. Buckets larger
+// than memory_cap bytes are scattered into smaller buckets first. The
+// bucket is removed afterwards.
+void shuffle_bucket(const std::string& fname, long memory_cap, std::mt19937_64& random_engine, ShuffledWriter& writer) {
+  long size = file_size(fname);
+  FILE* bucket = fopen(fname.c_str(), "rb");
+  CHECK(bucket != nullptr) << "Could not open bucket " << fname;
+  std::string record;
+  if(size > memory_cap) {
+    int n_buckets = (int)(2 * size / memory_cap) + 1;
+    LOG(INFO) << fname << " exceeds the memory limit, splitting it into " << n_buckets << " buckets.";
+    Buckets buckets(fname, n_buckets, random_engine);
+    while(read_record(bucket, &record)) {
+      buckets.add(record);
+    }
+    fclose(bucket);
+    std::remove(fname.c_str());
+    for(const auto& sub_fname : buckets.close()) {
+      shuffle_bucket(sub_fname, memory_cap, random_engine, writer);
+    }
+    return;
+  }
+
+  std::vector<std::string> records;
+  while(read_record(bucket, &record)) {
+    records.push_back(record);
+  }
+  fclose(bucket);
+  std::remove(fname.c_str());
+  std::shuffle(records.begin(), records.end(), random_engine);
+  for(const auto& shuffled_record : records) {
+    writer.write(shuffled_record);
+  }
+}
+
+
+// Shuffle databases in lockstep. All dbs are read sequentially once and
+// their records are scattered into buckets at random on disk, then every
+// bucket is shuffled in memory and written to the output dbs, such that
+// only --memory_mb of records are held in memory.
 int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Shuffle databases with the same keys in lockstep into <db>_shuffled.\n"
+                          "Usage: shuffle [FLAGS] db1 [db2 ...]");
+
   google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
 
   if(argc < 3) {
     LOG(ERROR) << "Usage: " << argv[0] << " db1 [db2 ...]";
     return 1;
   }
 
-  std::mt19937 random_engine{std::random_device{}()};
+  uint64_t seed = FLAGS_seed >= 0 ? (uint64_t)FLAGS_seed : std::random_device{}();
+  std::cout << "Shuffling with seed " << seed << "." << std::endl;
+  std::mt19937_64 random_engine{seed};
 
   int n_dbs = argc - 1;
   // open input dbs
@@ -31,16 +203,47 @@ int main(int argc, char** argv) {
   options.error_if_exists = false;
   options.create_if_missing = false;
   options.max_open_files = 100;
+  // the dbs are read once sequentially
+  leveldb::ReadOptions read_options;
+  read_options.fill_cache = false;
   std::vector<leveldb::DB*> dbs(dbnames.size());
   std::vector<leveldb::Iterator*> its(dbnames.size());
+  std::vector<DatasetManifest> manifests(dbnames.size());
   for(int i = 0; i < dbs.size(); ++i) {
     dbs[i] = open_leveldb(dbnames[i], options);
-    its[i] = dbs[i]->NewIterator(leveldb::ReadOptions());
-    its[i]->SeekToFirst();
+    manifests[i] = dataset_manifest(dbnames[i], dbs[i]);
+    its[i] = dbs[i]->NewIterator(read_options);
+  }
+
+  // number of buckets from the size of the dbs on disk, with a margin for
+  // differences in bucket size and compression
+  const long memory_cap = (long)FLAGS_memory_mb << 20;
+  CHECK(memory_cap > 0) << "--memory_mb must be positive.";
+  int n_buckets = FLAGS_buckets;
+  if(n_buckets <= 0) {
+    its[0]->SeekToLast();
+    std::string last_key = its[0]->Valid() ? its[0]->key().ToString() + '\0' : "";
+    uint64_t total_size = 0;
+    for(int i = 0; i < n_dbs; ++i) {
+      leveldb::Range range("", last_key);
+      uint64_t size = 0;
+      dbs[i]->GetApproximateSizes(&range, 1, &size);
+      total_size += size;
+    }
+    n_buckets = (int)(2 * total_size / memory_cap) + 1;
   }
+  std::cout << "Scattering into " << n_buckets << " buckets." << std::endl;
 
-  // collect all keys
+  std::string tmp_dir = FLAGS_tmp_dir.empty() ? dbnames[0] + "_shuffle_tmp" : FLAGS_tmp_dir;
+  CHECK(mkdir(tmp_dir.c_str(), 0700) == 0) << "Could not create " << tmp_dir << ", it might already exist.";
+
+  // scatter records of all dbs into buckets, keep the keys in order
   std::vector<std::string> keys;
+  Buckets buckets(tmp_dir + "/bucket", n_buckets, random_engine);
+  std::string record;
+  for(auto it : its) {
+    it->SeekToFirst();
+  }
   while(its[0]->Valid()) {
     check_same_state(its);
 
@@ -49,29 +252,37 @@ int main(int argc, char** argv) {
     keys.push_back(key_0);
 
     // make sure dbs are synchronized
-    for(unsigned int i = 1; i < n_dbs; ++i) {
-      auto key_i = its[i]->key().ToString();
-      CHECK(key_0 == key_i) << "Differing keys: " << key_0 << " != " << key_i;
+    record.clear();
+    for(unsigned int i = 0; i < n_dbs; ++i) {
+      if(i > 0) {
+        auto key_i = its[i]->key().ToString();
+        CHECK(key_0 == key_i) << "Differing keys: " << key_0 << " != " << key_i;
+      }
+      append_value(its[i]->value(), &record);
     }
+    buckets.add(record);
 
     // advance all iterators
     for(unsigned int i = 0; i < n_dbs; ++i) {
       its[i]->Next();
     }
+    if(keys.size() % 5000 == 0) {
+      std::cout << "Scattered " << keys.size() << " entries." << std::endl;
+    }
   }
   check_same_state(its);
-
-  // shuffle
-  std::vector<std::string> shuffled_keys(keys);
-  std::shuffle(shuffled_keys.begin(), shuffled_keys.end(), random_engine);
+  for(int i = 0; i < n_dbs; ++i) {
+    CHECK(its[i]->status().ok()) << its[i]->status().ToString();
+    delete its[i];
+    delete dbs[i];
+  }
+  auto bucket_fnames = buckets.close();
 
   // prepare output dbs
   leveldb::Options output_options;
   output_options.error_if_exists = true;
   output_options.create_if_missing = true;
   output_options.max_open_files = 100;
-  leveldb::WriteOptions write_options;
-  leveldb::ReadOptions read_options;
   std::vector<std::string> out_dbnames(n_dbs);
   std::vector<leveldb::DB*> out_dbs(dbnames.size());
   for(int i = 0; i < n_dbs; ++i) {
@@ -80,21 +291,22 @@ int main(int argc, char** argv) {
   }
 
   // write original keys with shuffled data
-  std::string value;
-  unsigned int count = 0;
-  unsigned int info_iter = 5000;
-  for(unsigned int i = 0; i < keys.size(); ++i) {
-    for(unsigned int db = 0; db < n_dbs; ++db) {
-      auto s = dbs[db]->Get(read_options, shuffled_keys[i], &value);
-      CHECK(s.ok()) << s.ToString();
-      s = out_dbs[db]->Put(write_options, keys[i], value);
-      CHECK(s.ok()) << s.ToString();
-    }
-    if(count % info_iter == 0) {
-      std::cout << "Shuffled " << count << " entries." << std::endl;
-    }
-    count += 1;
+  ShuffledWriter writer(out_dbs, keys, FLAGS_batch_size);
+  for(const auto& fname : bucket_fnames) {
+    shuffle_bucket(fname, memory_cap, random_engine, writer);
+  }
+  writer.flush();
+  CHECK(writer.written() == keys.size()) << "Wrote " << writer.written() << " of " << keys.size() << " entries.";
+  for(auto db : out_dbs) {
+    delete db;
   }
+  rmdir(tmp_dir.c_str());
+  for(int i = 0; i < n_dbs; ++i) {
+    manifests[i].count = keys.size();
+    manifests[i].add_step("shuffle with seed " + std::to_string(seed));
+    write_manifest(out_dbnames[i], manifests[i]);
+  }
+
   std::cout << "Shuffled a total of " << keys.size() << " entries into ";
   for(unsigned int i = 0; i < n_dbs; ++i) {
     std::cout << out_dbnames[i];
@@ -1,16 +1,111 @@
 #include "utils.h"
+#include "bounded_queue.h"
+#include "manifest.h"
+#include "datum_codec.h"
 
+#include <gflags/gflags.h>
+#include <leveldb/write_batch.h>
+
+#include <algorithm>
 #include <iostream>
+#include <thread>
 
 const int ASCII_ESC = 27;
 
+DEFINE_int32(threads, 0, "Number of threads parsing and serializing entries. 0 to use the number of cores.");
+DEFINE_int32(chunk_size, 32, "Number of entries handed from one stage of the pipeline to the next at once.");
+DEFINE_int32(queue_size, 8, "Number of chunks queued between the stages of the pipeline.");
+DEFINE_int32(batch_size, 256, "Number of entries written to each output db at once.");
+DEFINE_string(encode, "", "Encode the frames of the input db as png or jpg. Empty to store raw frames.");
+DEFINE_int32(encode_quality, -1, "JPEG quality (0 to 100) or PNG compression level (0 to 9) of --encode. -1 for the default.");
+
+// keys and values handed between the stages of the pipeline
+typedef std::vector<std::pair<std::string, std::string>> Chunk;
+
+
+// split chunks of original datums into chunks of input and target datums
+void split_chunks(BoundedQueue<Chunk>& original_chunks, BoundedQueue<Chunk>& input_chunks, BoundedQueue<Chunk>& target_chunks,
+                  const std::vector<unsigned int>& shape, unsigned int float_data_size, const FrameEncoding& encoding) {
+  // datum containing input together with targets in float_data field
+  caffe::Datum original_datum;
+  // the input datum
+  caffe::Datum input_datum;
+  input_datum.set_channels(shape[0]);
+  input_datum.set_height(shape[1]);
+  input_datum.set_width(shape[2]);
+  // the target datum
+  caffe::Datum target_datum;
+  target_datum.set_channels(1);
+  target_datum.set_height(1);
+  target_datum.set_width(float_data_size);
+
+  Chunk original_chunk;
+  while(original_chunks.pop(&original_chunk)) {
+    Chunk input_chunk(original_chunk.size()), target_chunk(original_chunk.size());
+    for(unsigned int i = 0; i < original_chunk.size(); ++i) {
+      original_datum.ParseFromString(original_chunk[i].second);
+
+      // copy data to input datum, encoded if requested
+      input_datum.set_data(original_datum.data());
+      input_datum.set_encoded(original_datum.encoded());
+      if(encoding.enabled()) {
+        decode_datum(&input_datum);
+        encode_datum(encoding, &input_datum);
+      }
+      input_chunk[i].first = original_chunk[i].first;
+      input_datum.SerializeToString(&input_chunk[i].second);
+
+      // copy float data to target datum
+      *(target_datum.mutable_float_data()) = original_datum.float_data();
+      target_chunk[i].first = std::move(original_chunk[i].first);
+      target_datum.SerializeToString(&target_chunk[i].second);
+    }
+    input_chunks.push(std::move(input_chunk));
+    target_chunks.push(std::move(target_chunk));
+  }
+}
+
+
+// write chunks to db in batches of batch_size entries
+void write_chunks(BoundedQueue<Chunk>& chunks, leveldb::DB* db, int batch_size) {
+  leveldb::WriteBatch batch;
+  leveldb::WriteOptions write_options;
+  int batched = 0;
+  Chunk chunk;
+  while(chunks.pop(&chunk)) {
+    for(const auto& entry : chunk) {
+      batch.Put(entry.first, entry.second);
+    }
+    batched += chunk.size();
+    if(batched >= batch_size) {
+      auto s = db->Write(write_options, &batch);
+      CHECK(s.ok()) << s.ToString();
+      batch.Clear();
+      batched = 0;
+    }
+  }
+  if(batched > 0) {
+    auto s = db->Write(write_options, &batch);
+    CHECK(s.ok()) << s.ToString();
+  }
+}
+
+
 // split a leveldb that contains caffe::Datums with float_data into two
 // leveldb databases, the first containing the image in a Datum, the other
 // containing the float_data as a Datum. Then it is easier to perform
 // regression because using a data layer, input datums that have no
 // uint8 data will be processed as float_data.
+//
+// The input db is read on the main thread, --threads workers parse,
+// optionally encode (--encode) and serialize the datums and one thread per
+// output db writes them, connected by bounded queues.
 int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Split a database of datums with float_data into databases of inputs and targets.\n"
+                          "Usage: split [FLAGS] input_db out_prefix");
+
   google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
 
   if(argc != 3) {
     LOG(ERROR) << "Usage: " << argv[0] << " input_db out_prefix";
@@ -24,8 +119,9 @@ int main(int argc, char** argv) {
   options.create_if_missing = false;
   options.max_open_files = 100;
   auto db = open_leveldb(dbname, options);
-  auto shape = infer_shape(db);
-  auto float_data_size = infer_float_data_size(db);
+  auto manifest = dataset_manifest(dbname, db);
+  auto shape = manifest.shape();
+  auto float_data_size = manifest.float_data_size;
   std::cout << "Inferred shape: " << shape[0] << " " << shape[1] << " " << shape[2] << std::endl;
   std::cout << "Inferred float_data_size: " << float_data_size << std::endl;
   CHECK(float_data_size > 0) << "Can not split dataset which contains no float data.";
@@ -44,47 +140,66 @@ int main(int argc, char** argv) {
   std::string target_dbname = std::string(argv[2]) + "_target";
   auto target_db = open_leveldb(target_dbname, output_options);
 
-  // datum containing input together with targets in float_data field
-  caffe::Datum original_datum;
-  // the input datum
-  caffe::Datum input_datum;
-  input_datum.set_channels(shape[0]);
-  input_datum.set_height(shape[1]);
-  input_datum.set_width(shape[2]);
-  // the target datum
-  caffe::Datum target_datum;
-  target_datum.set_channels(1);
-  target_datum.set_height(1);
-  target_datum.set_width(float_data_size);
+  const FrameEncoding encoding(FLAGS_encode, FLAGS_encode_quality);
 
-  leveldb::WriteOptions write_options;
-  std::string serialized_datum;
+  // start the pipeline
+  int n_threads = FLAGS_threads > 0 ? FLAGS_threads : std::max(1u, std::thread::hardware_concurrency());
+  BoundedQueue<Chunk> original_chunks(FLAGS_queue_size), input_chunks(FLAGS_queue_size), target_chunks(FLAGS_queue_size);
+  std::vector<std::thread> workers;
+  for(int i = 0; i < n_threads; ++i) {
+    workers.emplace_back(split_chunks, std::ref(original_chunks), std::ref(input_chunks), std::ref(target_chunks),
+                         std::cref(shape), float_data_size, std::cref(encoding));
+  }
+  std::thread input_writer(write_chunks, std::ref(input_chunks), input_db, FLAGS_batch_size);
+  std::thread target_writer(write_chunks, std::ref(target_chunks), target_db, FLAGS_batch_size);
 
   // iterate over original db
-  auto it = db->NewIterator(leveldb::ReadOptions());
+  leveldb::ReadOptions read_options;
+  read_options.fill_cache = false;
+  auto it = db->NewIterator(read_options);
   unsigned int count = 0;
   unsigned int info_iter = 5000;
+  Chunk chunk;
   for(it->SeekToFirst(); it->Valid(); it->Next())
   {
     if(count % info_iter == 0) {
       std::cout << "Processed " << count << " entries." << std::endl;
     }
     count += 1;
-    std::string key = it->key().ToString();
-
-    original_datum.ParseFromString(it->value().ToString());
-
-    // copy data to input datum
-    input_datum.set_data(original_datum.data());
-    input_datum.SerializeToString(&serialized_datum);
-    input_db->Put(write_options, key, serialized_datum);
+    chunk.emplace_back(it->key().ToString(), it->value().ToString());
+    if((int)chunk.size() >= FLAGS_chunk_size) {
+      original_chunks.push(std::move(chunk));
+      chunk.clear();
+    }
+  }
+  if(!chunk.empty()) original_chunks.push(std::move(chunk));
+  CHECK(it->status().ok()) << it->status().ToString();
+  delete it;
 
-    // copy float data to target datum
-    *(target_datum.mutable_float_data()) = original_datum.float_data();
-    target_datum.SerializeToString(&serialized_datum);
-    target_db->Put(write_options, key, serialized_datum);
+  // drain the pipeline
+  original_chunks.close();
+  for(auto& worker : workers) {
+    worker.join();
   }
+  input_chunks.close();
+  target_chunks.close();
+  input_writer.join();
+  target_writer.join();
+  delete input_db;
+  delete target_db;
+  delete db;
   std::cout << "Split a total of " << count << " keys." << std::endl;
 
+  manifest.count = count;
+  DatasetManifest input_manifest = manifest, target_manifest = manifest;
+  input_manifest.float_data_size = 0;
+  input_manifest.add_step("split inputs");
+  write_manifest(input_dbname, input_manifest);
+  target_manifest.channels = 1;
+  target_manifest.height = 1;
+  target_manifest.width = float_data_size;
+  target_manifest.add_step("split targets");
+  write_manifest(target_dbname, target_manifest);
+
   return 0;
 }
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Lock-free histogram of durations in nanoseconds. Buckets are logarithmic
+// with 2^sub_bucket_bits linear sub-buckets per power of two, i.e. values
+// are resolved to about 6%. Recording only uses relaxed atomic operations
+// and can be done from any thread.
+class LatencyHistogram {
+  public:
+    static const int sub_bucket_bits = 4;
+    static const int sub_buckets = 1 << sub_bucket_bits;
+    static const int n_buckets = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+    // statistics over all values recorded since the last snapshot
+    struct Summary {
+      uint64_t count;
+      double p50_us;
+      double p99_us;
+      double max_us;
+      double mean_us;
+    };
+
+    LatencyHistogram() : counts(n_buckets), sum(0), max(0) {}
+
+    void record(uint64_t ns) {
+      counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+      sum.fetch_add(ns, std::memory_order_relaxed);
+      uint64_t previous = max.load(std::memory_order_relaxed);
+      while(ns > previous && !max.compare_exchange_weak(previous, ns, std::memory_order_relaxed)) {}
+    }
+
+    // record time elapsed since start
+    void record_since(std::chrono::steady_clock::time_point start) {
+      record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    // summarize and reset the histogram
+    Summary snapshot() {
+      std::vector<uint64_t> values(n_buckets);
+      uint64_t total = 0;
+      for(int i = 0; i < n_buckets; ++i) {
+        values[i] = counts[i].exchange(0, std::memory_order_relaxed);
+        total += values[i];
+      }
+      Summary summary;
+      summary.count = total;
+      summary.mean_us = total > 0 ? sum.exchange(0, std::memory_order_relaxed) / 1000. / total : 0;
+      summary.max_us = max.exchange(0, std::memory_order_relaxed) / 1000.;
+      summary.p50_us = percentile(values, total, 0.5) / 1000.;
+      summary.p99_us = percentile(values, total, 0.99) / 1000.;
+      return summary;
+    }
+
+  protected:
+    static int bucket(uint64_t ns) {
+      if(ns < (uint64_t)sub_buckets) return (int)ns;
+      int exponent = 63 - __builtin_clzll(ns);
+      return (exponent - sub_bucket_bits + 1) * sub_buckets + (int)((ns >> (exponent - sub_bucket_bits)) & (sub_buckets - 1));
+    }
+
+    // smallest value that falls into bucket i
+    static uint64_t lower_bound(int i) {
+      if(i < sub_buckets) return i;
+      int exponent = i / sub_buckets + sub_bucket_bits - 1;
+      return (uint64_t)(sub_buckets + i % sub_buckets) << (exponent - sub_bucket_bits);
+    }
+
+    // upper bound of the bucket containing the p-th quantile
+    static double percentile(const std::vector<uint64_t>& values, uint64_t total, double p) {
+      if(total == 0) return 0;
+      uint64_t rank = (uint64_t)(p * (total - 1)) + 1;
+      uint64_t seen = 0;
+      for(int i = 0; i < n_buckets; ++i) {
+        seen += values[i];
+        if(seen >= rank) return i + 1 < n_buckets ? lower_bound(i + 1) : lower_bound(i);
+      }
+      return lower_bound(n_buckets - 1);
+    }
+
+    std::vector<std::atomic<uint64_t>> counts;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+};
+
+
+// Named latency histograms, e.g. one per stage of the control loop, and
+// event counters that are reported together every interval seconds.
+class LatencyStats {
+  public:
+    LatencyStats(double interval, const std::string& fname)
+      : interval(interval), fname(fname), start(std::chrono::steady_clock::now()) {}
+
+    // add a histogram, must not be called after recording started
+    LatencyHistogram& add(const std::string& name) {
+      names.push_back(name);
+      histograms.emplace_back(new LatencyHistogram());
+      return *histograms.back();
+    }
+
+    // add a counter of events, must not be called after recording started
+    std::atomic<uint64_t>& add_counter(const std::string& name) {
+      counter_names.push_back(name);
+      counters.emplace_back(new std::atomic<uint64_t>(0));
+      return *counters.back();
+    }
+
+    // report and reset the histograms if interval has passed since the last
+    // report. Reports are logged or, if fname is not empty, written to fname.
+    void maybe_report() {
+      auto now = std::chrono::steady_clock::now();
+      double elapsed = std::chrono::duration<double>(now - start).count();
+      if(interval <= 0 || elapsed < interval) return;
+      start = now;
+
+      std::stringstream ss;
+      ss << std::fixed << std::setprecision(1);
+      ss << std::setw(12) << "stage" << std::setw(10) << "count" << std::setw(12) << "mean_us"
+         << std::setw(12) << "p50_us" << std::setw(12) << "p99_us" << std::setw(12) << "max_us" << std::endl;
+      for(unsigned int i = 0; i < histograms.size(); ++i) {
+        auto summary = histograms[i]->snapshot();
+        ss << std::setw(12) << names[i] << std::setw(10) << summary.count << std::setw(12) << summary.mean_us
+           << std::setw(12) << summary.p50_us << std::setw(12) << summary.p99_us << std::setw(12) << summary.max_us << std::endl;
+      }
+      if(!counters.empty()) {
+        ss << std::setw(12) << "counter" << std::setw(10) << "count" << std::endl;
+      }
+      for(unsigned int i = 0; i < counters.size(); ++i) {
+        ss << std::setw(12) << counter_names[i] << std::setw(10) << counters[i]->exchange(0, std::memory_order_relaxed) << std::endl;
+      }
+
+      if(fname.empty()) {
+        LOG(INFO) << "Latencies over the last " << elapsed << " seconds:" << std::endl << ss.str();
+      } else {
+        // replace atomically such that readers never see partial reports
+        std::string tmp_fname = fname + ".tmp";
+        std::ofstream out(tmp_fname);
+        out << ss.str();
+        out.close();
+        if(std::rename(tmp_fname.c_str(), fname.c_str()) != 0) {
+          LOG(WARNING) << "Could not write latency statistics to " << fname;
+        }
+      }
+    }
+
+  protected:
+    double interval;
+    std::string fname;
+    std::chrono::steady_clock::time_point start;
+    std::vector<std::string> names;
+    std::vector<std::unique_ptr<LatencyHistogram>> histograms;
+    std::vector<std::string> counter_names;
+    std::vector<std::unique_ptr<std::atomic<uint64_t>>> counters;
+};
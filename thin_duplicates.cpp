@@ -0,0 +1,258 @@
+#include "utils.h"
+#include "manifest.h"
+#include "datum_codec.h"
+
+#include <gflags/gflags.h>
+#include <leveldb/write_batch.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+
+DEFINE_int32(max_distance, 4, "Frames whose hashes differ in at most this many of 64 bits are near-duplicates.");
+DEFINE_int32(keep_every, 0, "Keep every n-th near-duplicate of a kept frame instead of dropping all of them. 0 to drop all.");
+DEFINE_int32(threads, 0, "Number of threads reading and decoding frames. 0 to use the number of cores.");
+DEFINE_int32(batch_size, 256, "Number of entries written to each output db at once.");
+
+
+// Perceptual hash of the raw image of datum: the signs of the 8x8 lowest
+// frequencies of the DCT of the 32x32 grayscale image relative to their
+// median. Similar images have hashes with a small Hamming distance.
+uint64_t perceptual_hash(const caffe::Datum& datum)
+{
+  const int channels = datum.channels(), height = datum.height(), width = datum.width();
+  const std::string& data = datum.data();
+  CHECK(data.size() == (size_t)channels * height * width) << "Datum has no raw image of its shape.";
+  cv::Mat gray(height, width, CV_32FC1, cv::Scalar(0));
+  for(int c = 0; c < channels; ++c) {
+    for(int h = 0; h < height; ++h) {
+      float* row = gray.ptr<float>(h);
+      for(int w = 0; w < width; ++w) {
+        row[w] += (uint8_t)data[(c * height + h) * width + w];
+      }
+    }
+  }
+  cv::Mat small, frequencies;
+  cv::resize(gray, small, cv::Size(32, 32), 0, 0, cv::INTER_AREA);
+  cv::dct(small, frequencies);
+
+  float low[64];
+  for(int y = 0; y < 8; ++y) {
+    for(int x = 0; x < 8; ++x) {
+      low[y * 8 + x] = frequencies.at<float>(y, x);
+    }
+  }
+  // the DC component only reflects the brightness, leave it out of the median
+  float sorted[63];
+  std::copy(low + 1, low + 64, sorted);
+  std::nth_element(sorted, sorted + 31, sorted + 63);
+  const float median = sorted[31];
+  uint64_t hash = 0;
+  for(int i = 0; i < 64; ++i) {
+    hash = hash << 1 | (low[i] > median ? 1 : 0);
+  }
+  return hash;
+}
+
+int hamming_distance(uint64_t a, uint64_t b)
+{
+  return __builtin_popcountll(a ^ b);
+}
+
+
+// Multi-index hashing: the 64 bit hashes are split into four 16 bit parts,
+// each indexed by its own table. Two hashes within distance r differ in at
+// most r / 4 bits of at least one part, so only the hashes in the buckets
+// of parts within that distance of the parts of the query are compared.
+class HashIndex {
+  public:
+    explicit HashIndex(int max_distance) : max_distance(max_distance), part_distance(max_distance / n_parts) {
+      CHECK(0 <= max_distance && max_distance < 64) << "Invalid distance " << max_distance;
+    }
+
+    void add(uint64_t hash, size_t id) {
+      hashes.push_back(hash);
+      ids.push_back(id);
+      for(int part = 0; part < n_parts; ++part) {
+        tables[part][part_of(hash, part)].push_back(hashes.size() - 1);
+      }
+    }
+
+    // id of an indexed hash within max_distance of hash, returns false if
+    // there is none
+    bool find(uint64_t hash, size_t* id) const {
+      for(int part = 0; part < n_parts; ++part) {
+        bool found = false;
+        for_each_neighbour(part_of(hash, part), 0, part_distance, [&](uint16_t neighbour) {
+          if(found) return;
+          auto bucket = tables[part].find(neighbour);
+          if(bucket == tables[part].end()) return;
+          for(size_t entry : bucket->second) {
+            if(hamming_distance(hashes[entry], hash) <= max_distance) {
+              *id = ids[entry];
+              found = true;
+              return;
+            }
+          }
+        });
+        if(found) return true;
+      }
+      return false;
+    }
+
+  protected:
+    static const int n_parts = 4;
+
+    static uint16_t part_of(uint64_t hash, int part) {
+      return (uint16_t)(hash >> (16 * part));
+    }
+
+    // call f for all values within distance of value that differ from it
+    // only in bits from first_bit on
+    template <class F>
+    static void for_each_neighbour(uint16_t value, int first_bit, int distance, F f) {
+      f(value);
+      if(distance == 0) return;
+      for(int bit = first_bit; bit < 16; ++bit) {
+        for_each_neighbour(value ^ (1 << bit), bit + 1, distance - 1, f);
+      }
+    }
+
+    int max_distance, part_distance;
+    std::vector<uint64_t> hashes;
+    std::vector<size_t> ids;
+    std::unordered_map<uint16_t, std::vector<size_t>> tables[n_parts];
+};
+
+
+// Write entries to a db in batches.
+class BatchedWriter {
+  public:
+    BatchedWriter(leveldb::DB* db, int batch_size) : db(db), batch_size(batch_size), batched(0) {}
+
+    void put(const std::string& key, const std::string& value) {
+      batch.Put(key, value);
+      batched += 1;
+      if(batched >= batch_size) flush();
+    }
+
+    void flush() {
+      auto s = db->Write(leveldb::WriteOptions(), &batch);
+      CHECK(s.ok()) << s.ToString();
+      batch.Clear();
+      batched = 0;
+    }
+
+  protected:
+    leveldb::DB* db;
+    leveldb::WriteBatch batch;
+    int batch_size, batched;
+};
+
+
+// Remove near-duplicate frames from a dataset. The frames of input_db are
+// visited in the order of their keys and compared by their perceptual hash
+// to all frames kept so far. A frame is a near-duplicate if their hashes
+// differ in at most --max_distance bits. Kept frames and their targets are
+// written under their keys to <input_db>_thinned and <target_db>_thinned.
+// With --keep_every=n, every n-th near-duplicate of a kept frame is kept
+// as well, such that long runs of similar frames are downweighted rather
+// than reduced to a single frame.
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Remove near-duplicate frames from an input and a target database.\n"
+                          "Usage: thin_duplicates [FLAGS] input_db target_db");
+
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if(argc != 3) {
+    LOG(ERROR) << "Usage: " << argv[0] << " input_db target_db";
+    return 1;
+  }
+
+  leveldb::Options options;
+  options.error_if_exists = false;
+  options.create_if_missing = false;
+  options.max_open_files = 100;
+  std::string input_dbname(argv[1]), target_dbname(argv[2]);
+  auto input_db = open_leveldb(input_dbname, options);
+  auto target_db = open_leveldb(target_dbname, options);
+  auto input_manifest = dataset_manifest(input_dbname, input_db);
+  auto target_manifest = dataset_manifest(target_dbname, target_db);
+
+  leveldb::Options output_options;
+  output_options.error_if_exists = true;
+  output_options.create_if_missing = true;
+  output_options.max_open_files = 100;
+  std::string out_input_dbname = input_dbname + "_thinned",
+              out_target_dbname = target_dbname + "_thinned";
+  auto out_input_db = open_leveldb(out_input_dbname, output_options);
+  auto out_target_db = open_leveldb(out_target_dbname, output_options);
+  BatchedWriter input_writer(out_input_db, FLAGS_batch_size), target_writer(out_target_db, FLAGS_batch_size);
+
+  // the frames are decoded for hashing but written as they are stored
+  leveldb::ReadOptions read_options;
+  read_options.fill_cache = false;
+  auto target_it = target_db->NewIterator(read_options);
+  std::unique_ptr<DatumReader> reader(new DatumReader(input_db, FLAGS_threads));
+
+  HashIndex index(FLAGS_max_distance);
+  // number of near-duplicates seen of every kept frame
+  std::vector<unsigned int> duplicates;
+  caffe::Datum datum;
+  std::string key, value, last_key;
+  unsigned int count = 0, kept = 0;
+  unsigned int info_iter = 5000;
+  for(target_it->SeekToFirst(); reader->next(&key, &datum, &value); target_it->Next()) {
+    CHECK(target_it->Valid() && target_it->key() == key) << "Missing target for key " << key;
+    if(count % info_iter == 0) {
+      std::cout << "Processed " << count << " entries, kept " << kept << "." << std::endl;
+    }
+    count += 1;
+
+    uint64_t hash = perceptual_hash(datum);
+    size_t original;
+    bool keep = true;
+    if(index.find(hash, &original)) {
+      duplicates[original] += 1;
+      keep = FLAGS_keep_every > 0 && duplicates[original] % FLAGS_keep_every == 0;
+    } else {
+      index.add(hash, duplicates.size());
+      duplicates.push_back(0);
+    }
+    if(keep) {
+      input_writer.put(key, value);
+      target_writer.put(key, target_it->value().ToString());
+      last_key = key;
+      kept += 1;
+    }
+  }
+  CHECK(!target_it->Valid()) << "Missing input for key " << target_it->key().ToString();
+  CHECK(target_it->status().ok()) << target_it->status().ToString();
+  input_writer.flush();
+  target_writer.flush();
+  reader.reset();
+  delete target_it;
+  delete input_db;
+  delete target_db;
+  delete out_input_db;
+  delete out_target_db;
+
+  std::stringstream step;
+  step << "thin_duplicates within " << FLAGS_max_distance << " bits";
+  if(FLAGS_keep_every > 0) step << " keeping every " << FLAGS_keep_every << "th";
+  for(auto manifest : {std::make_pair(out_input_dbname, input_manifest), std::make_pair(out_target_dbname, target_manifest)}) {
+    manifest.second.count = kept;
+    manifest.second.last_key = last_key;
+    manifest.second.add_step(step.str());
+    write_manifest(manifest.first, manifest.second);
+  }
+
+  std::cout << "Kept " << kept << " of " << count << " entries (" << duplicates.size() << " distinct frames) in "
+            << out_input_dbname << " and " << out_target_dbname << "." << std::endl;
+
+  return 0;
+}
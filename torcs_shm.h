@@ -0,0 +1,606 @@
+#pragma once
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+#include <linux/futex.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+const int n_channels = 3;
+// image size as captured from torcs
+const int image_width = 640;
+const int image_height = 480;
+// image size used for network input
+const int net_image_width = 280;
+const int net_image_height = 210;
+
+// key of the shared memory segment, torcs must use the same
+const key_t shm_key = (key_t)4567;
+
+// the flags in shared memory are accessed with atomic operations and must
+// have the same layout as the plain ints torcs uses
+static_assert(sizeof(std::atomic<int>) == sizeof(int), "std::atomic<int> must have the size of int.");
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "std::atomic<int> must be lock free to be shared between processes.");
+
+
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Sleep while *addr == expected, for at most timeout_us microseconds. The
+// futex is not process private such that it works on shared memory.
+inline void futex_wait(std::atomic<int>* addr, int expected, long timeout_us)
+{
+  struct timespec timeout;
+  timeout.tv_sec = timeout_us / 1000000;
+  timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+  syscall(SYS_futex, reinterpret_cast<int*>(addr), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+// wake all threads and processes sleeping on addr
+inline void futex_wake(std::atomic<int>* addr)
+{
+  syscall(SYS_futex, reinterpret_cast<int*>(addr), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// Wait while *addr == value. Spins for spin_us microseconds and then sleeps
+// on the futex of addr. Writers that wake the futex are noticed
+// immediately, for writers that only store the value it is rechecked every
+// poll_us microseconds. Returns false if the value did not change within
+// timeout_us microseconds (negative to wait forever).
+inline bool wait_while_equal(std::atomic<int>* addr, int value, long timeout_us, long poll_us, long spin_us = 0)
+{
+  if(addr->load(std::memory_order_acquire) != value) return true;
+  auto start = std::chrono::steady_clock::now();
+  auto elapsed_us = [&start]() {
+    return (long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  };
+  while(elapsed_us() < spin_us) {
+    if(addr->load(std::memory_order_acquire) != value) return true;
+    cpu_relax();
+  }
+  while(addr->load(std::memory_order_acquire) == value) {
+    long wait_us = poll_us;
+    if(timeout_us >= 0) {
+      long remaining_us = timeout_us - elapsed_us();
+      if(remaining_us <= 0) return false;
+      wait_us = std::min(wait_us, remaining_us);
+    }
+    futex_wait(addr, value, wait_us);
+  }
+  return true;
+}
+
+
+// Ground truth affordances and state of the car as reported by torcs.
+struct GroundTruth
+{
+    double fast;
+
+    double dist_L;
+    double dist_R;
+
+    double toMarking_L;
+    double toMarking_M;
+    double toMarking_R;
+
+    double dist_LL;
+    double dist_MM;
+    double dist_RR;
+
+    double toMarking_LL;
+    double toMarking_ML;
+    double toMarking_MR;
+    double toMarking_RR;
+
+    double toMiddle;
+    double angle;
+    double speed;
+};
+
+// Commands sent to torcs.
+struct Commands
+{
+    double steer;
+    double accel;
+    double brake;
+};
+
+// simple controller for accelerating and braking to reach desired_speed
+inline void apply_speed_control(Commands& commands, const float desired_speed, const double speed)
+{
+  if (desired_speed >= speed) {
+    commands.accel = 0.2*(desired_speed - speed + 1);
+    if(commands.accel > 1) commands.accel = 1.0;
+    commands.brake = 0.0;
+  } else {
+    commands.brake = 0.1*(speed - desired_speed);
+    if(commands.brake > 1) commands.brake = 1.0;
+    commands.accel = 0.0;
+  }
+}
+
+
+// Struct used for shared memory communication with torcs.
+//
+// Handshake protocol: the producer (torcs) writes a frame and the ground
+// truth, then publishes written = 1. The consumer waits for written == 1,
+// reads the frame, writes the commands and releases written = 0, after
+// which the producer reads the commands. Stores to written have release
+// and loads acquire semantics, so everything written before a flip of the
+// flag is visible to the other side after it observed the flip. Both sides
+// wake the other through a futex on written. Producers that only set the
+// flag still work, the consumer then rechecks it periodically.
+struct SharedStruct
+{  
+    std::atomic<int> written;  //a label, if 1: available to read, if 0: available to write
+    uint8_t data[image_width*image_height*3];  // image data field  
+    int control;
+    int pause;
+    double fast;
+
+    double dist_L;
+    double dist_R;
+
+    double toMarking_L;
+    double toMarking_M;
+    double toMarking_R;
+
+    double dist_LL;
+    double dist_MM;
+    double dist_RR;
+
+    double toMarking_LL;
+    double toMarking_ML;
+    double toMarking_MR;
+    double toMarking_RR;
+
+    double toMiddle;
+    double angle;
+    double speed;
+
+    double steerCmd;
+    double accelCmd;
+    double brakeCmd;
+
+    void clear() {
+      written = 0;
+      control = 0;
+      pause = 0;
+      fast = 0;
+      dist_L = 0;
+      dist_R = 0;
+      toMarking_L = 0;
+      toMarking_M = 0;
+      toMarking_R = 0;
+      dist_LL = 0;
+      dist_MM = 0;
+      dist_RR = 0;
+      toMarking_LL = 0;
+      toMarking_ML = 0;
+      toMarking_MR = 0;
+      toMarking_RR = 0;
+      toMiddle = 0;
+      angle = 0;
+      speed = 0;
+      
+      steerCmd = 0;
+      accelCmd = 0;
+      brakeCmd = 0;
+    }
+
+    // Consumer side: wait until a frame is available, see
+    // wait_while_equal. A producer that calls publish() wakes the consumer
+    // immediately. Returns false if no frame arrived within timeout_us.
+    bool wait_written(long timeout_us, long poll_us = 200, long spin_us = 0) {
+      return wait_while_equal(&written, 0, timeout_us, poll_us, spin_us);
+    }
+
+    // Consumer side: signal that the frame has been processed and the
+    // commands are valid.
+    void release() {
+      written.store(0, std::memory_order_release);
+      futex_wake(&written);
+    }
+
+    // Producer side: signal that a new frame and ground truth are
+    // available.
+    void publish() {
+      written.store(1, std::memory_order_release);
+      futex_wake(&written);
+    }
+
+    // Producer side: wait until the consumer released the frame.
+    bool wait_released(long timeout_us, long poll_us = 200) {
+      return wait_while_equal(&written, 1, timeout_us, poll_us);
+    }
+
+    GroundTruth ground_truth() const {
+      return {fast, dist_L, dist_R, toMarking_L, toMarking_M, toMarking_R,
+              dist_LL, dist_MM, dist_RR, toMarking_LL, toMarking_ML, toMarking_MR, toMarking_RR,
+              toMiddle, angle, speed};
+    }
+
+    void set_ground_truth(const GroundTruth& gt) {
+      fast = gt.fast;
+      dist_L = gt.dist_L;
+      dist_R = gt.dist_R;
+      toMarking_L = gt.toMarking_L;
+      toMarking_M = gt.toMarking_M;
+      toMarking_R = gt.toMarking_R;
+      dist_LL = gt.dist_LL;
+      dist_MM = gt.dist_MM;
+      dist_RR = gt.dist_RR;
+      toMarking_LL = gt.toMarking_LL;
+      toMarking_ML = gt.toMarking_ML;
+      toMarking_MR = gt.toMarking_MR;
+      toMarking_RR = gt.toMarking_RR;
+      toMiddle = gt.toMiddle;
+      angle = gt.angle;
+      speed = gt.speed;
+    }
+};
+
+
+// Attach to the shared memory segment with the given key and size and
+// create it if it does not exist yet.
+inline void* attach_shared_memory(key_t key, size_t size)
+{
+  // see also man shmget
+  int perm = 0600;             // permission mode
+  int shm_flags = IPC_CREAT | perm;
+  int shm_id = shmget(key, size, shm_flags);
+  CHECK(shm_id != -1) << "shmget() unsuccessful. A segment with key " << key
+    << " and a size smaller than " << size << " bytes might already exist, see ipcs and ipcrm.";
+  void* shm = shmat(shm_id, 0, 0);
+  CHECK(shm != (void*)-1) << "shmat() unsuccessful.";
+  return shm;
+}
+
+// Keep the shared memory segment with the given key in RAM until it is
+// removed (SHM_LOCK). Fails if the process lacks CAP_IPC_LOCK and its
+// memlock limit is too small.
+inline void lock_shared_memory(key_t key)
+{
+  int shm_id = shmget(key, 0, 0);
+  CHECK(shm_id != -1) << "shmget() unsuccessful, no segment with key " << key << ".";
+  if(shmctl(shm_id, SHM_LOCK, nullptr) != 0) {
+    LOG(FATAL) << "shmctl(SHM_LOCK) unsuccessful for segment with key " << key << ": " << strerror(errno)
+      << ". Locking memory requires CAP_IPC_LOCK or a large enough memlock limit (ulimit -l).";
+  }
+}
+
+// Attach to the shared memory segment used to communicate with torcs and
+// create it if it does not exist yet.
+inline SharedStruct* attach_shared_struct(key_t key = shm_key)
+{
+  return (SharedStruct*)attach_shared_memory(key, sizeof(SharedStruct));
+}
+
+
+// Versioned shared memory protocol with a ring of frame slots. Unlike
+// SharedStruct, the producer does not have to wait for the consumer before
+// writing the next frame, and commands carry the number of the frame they
+// answer.
+//
+// Frames are numbered from 1 and frame n lives in slot n % n_slots. The
+// producer marks a slot as being written by setting its frame number to 0,
+// writes image and ground truth, stores the frame number of the slot
+// (release) and finally publishes it in head (release, futex wake). The
+// consumer reads head (acquire), processes the slot and afterwards checks
+// that the frame number of the slot is unchanged, otherwise the producer
+// overwrote it in the meantime and the frame has to be dropped. Commands are
+// written under a sequence lock, answered is advanced afterwards (release,
+// futex wake).
+//
+// The consumer creates the segment and initializes the header, producers
+// check magic and version before using it.
+const uint32_t shared_ring_magic = 0x544f5243; // "TORC"
+const uint32_t shared_ring_version = 1;
+const int max_shared_ring_slots = 8;
+
+struct SharedRingSlot
+{
+    std::atomic<int> frame;  // number of the frame in this slot, 0 while it is written
+    GroundTruth ground_truth;
+    uint8_t data[image_width*image_height*n_channels];  // image data field
+};
+
+struct SharedRing
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_slots;
+    uint32_t slot_size;
+
+    std::atomic<int> head;      // number of the latest published frame
+    std::atomic<int> answered;  // number of the latest frame answered with commands
+    std::atomic<uint32_t> commands_lock;  // odd while commands are written
+    int commands_frame;         // number of the frame the commands answer
+    Commands commands;
+
+    int control;
+    int pause;
+
+    SharedRingSlot slots[max_shared_ring_slots];
+
+    // Consumer side: reset the ring and announce it to producers.
+    void init(int n) {
+      CHECK(0 < n && n <= max_shared_ring_slots) << "Number of slots must be in [1, " << max_shared_ring_slots << "].";
+      magic = 0;
+      std::atomic_thread_fence(std::memory_order_release);
+      version = shared_ring_version;
+      n_slots = n;
+      slot_size = sizeof(SharedRingSlot);
+      head = 0;
+      answered = 0;
+      commands_lock = 0;
+      commands_frame = 0;
+      commands = Commands{};
+      control = 0;
+      pause = 0;
+      for(int i = 0; i < max_shared_ring_slots; ++i) {
+        slots[i].frame = 0;
+      }
+      std::atomic_thread_fence(std::memory_order_release);
+      magic = shared_ring_magic;
+    }
+
+    // Producer side: check that the consumer initialized a compatible ring.
+    bool compatible() const {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return magic == shared_ring_magic && version == shared_ring_version &&
+        slot_size == sizeof(SharedRingSlot) && 0 < n_slots && n_slots <= max_shared_ring_slots;
+    }
+
+    SharedRingSlot& slot(int frame) {
+      return slots[frame % n_slots];
+    }
+
+    // Producer side: get the slot to write frame into.
+    SharedRingSlot& begin_frame(int frame) {
+      SharedRingSlot& s = slot(frame);
+      s.frame.store(0, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      return s;
+    }
+
+    // Producer side: publish frame after it was written to its slot.
+    void publish_frame(int frame) {
+      slot(frame).frame.store(frame, std::memory_order_release);
+      head.store(frame, std::memory_order_release);
+      futex_wake(&head);
+    }
+
+    // Producer side: wait until frame (or a later one) was answered.
+    bool wait_answer(int frame, long timeout_us, long poll_us = 200) {
+      auto start = std::chrono::steady_clock::now();
+      while(true) {
+        int last = answered.load(std::memory_order_acquire);
+        if(last >= frame) return true;
+        long remaining_us = timeout_us;
+        if(timeout_us >= 0) {
+          remaining_us -= (long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+          if(remaining_us <= 0) return false;
+        }
+        wait_while_equal(&answered, last, remaining_us, poll_us);
+      }
+    }
+
+    // Producer side: read the latest commands and the frame they answer.
+    Commands read_commands(int* frame) {
+      Commands result;
+      uint32_t before, after;
+      do {
+        before = commands_lock.load(std::memory_order_acquire);
+        result = commands;
+        *frame = commands_frame;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = commands_lock.load(std::memory_order_relaxed);
+      } while(before != after || (before & 1));
+      return result;
+    }
+
+    // Consumer side: wait until a frame newer than last was published.
+    bool wait_head(int last, long timeout_us, long poll_us = 200, long spin_us = 0) {
+      return wait_while_equal(&head, last, timeout_us, poll_us, spin_us);
+    }
+
+    // Consumer side: answer frame with commands.
+    void write_commands(int frame, const Commands& c) {
+      uint32_t lock = commands_lock.load(std::memory_order_relaxed);
+      commands_lock.store(lock + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      commands = c;
+      commands_frame = frame;
+      commands_lock.store(lock + 2, std::memory_order_release);
+      if(frame > answered.load(std::memory_order_relaxed)) {
+        answered.store(frame, std::memory_order_release);
+        futex_wake(&answered);
+      }
+    }
+};
+
+inline SharedRing* attach_shared_ring(key_t key = shm_key)
+{
+  return (SharedRing*)attach_shared_memory(key, sizeof(SharedRing));
+}
+
+
+// A frame acquired from a FrameSource. data points into shared memory and
+// may only be used until the frame is answered.
+struct Frame
+{
+    int number;
+    const uint8_t* data;
+    GroundTruth ground_truth;
+};
+
+// Consumer side of either shared memory protocol.
+class FrameSource {
+  public:
+    virtual ~FrameSource() {}
+
+    // wait until a frame newer than the last acquired one is available,
+    // returns false on timeout (negative to wait forever)
+    virtual bool wait_frame(long timeout_us) = 0;
+    // acquire the latest available frame, returns false if there is none
+    virtual bool acquire_frame(Frame* frame) = 0;
+    // check that the data of an acquired frame was not overwritten while
+    // it was read
+    virtual bool frame_valid(const Frame& frame) = 0;
+    // check whether a frame newer than an acquired one was published, may
+    // be called from any thread
+    virtual bool newer_frame(const Frame& frame) = 0;
+    // answer an acquired frame
+    virtual void send_commands(const Frame& frame, const Commands& commands) = 0;
+
+    // manual control
+    virtual Commands commands() = 0;
+    virtual void override_commands(const Commands& commands) = 0;
+    virtual int pause() = 0;
+    virtual void set_pause(int pause) = 0;
+};
+
+// FrameSource using SharedStruct. There is only a single frame in flight,
+// torcs waits for its commands before it renders the next frame.
+class LegacyFrameSource : public FrameSource {
+  public:
+    LegacyFrameSource(SharedStruct* shm, long poll_us, long spin_us)
+      : shm(shm), poll_us(poll_us), spin_us(spin_us), acquired(false), count(0) {}
+
+    bool wait_frame(long timeout_us) {
+      auto start = std::chrono::steady_clock::now();
+      auto elapsed_us = [&start]() {
+        return (long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+      };
+      // the acquired frame stays written until it is answered. torcs may
+      // publish the next frame before acquired is cleared, written is then
+      // 1 again, so acquired is rechecked at least every poll_us
+      while(acquired.load(std::memory_order_acquire)) {
+        long slice_us = poll_us;
+        if(timeout_us >= 0) {
+          long remaining_us = timeout_us - elapsed_us();
+          if(remaining_us <= 0) return false;
+          slice_us = std::min(slice_us, remaining_us);
+        }
+        wait_while_equal(&shm->written, 1, slice_us, poll_us);
+      }
+      return shm->wait_written(timeout_us < 0 ? timeout_us : std::max(timeout_us - elapsed_us(), 0L), poll_us, spin_us);
+    }
+
+    bool acquire_frame(Frame* frame) {
+      if(acquired.load(std::memory_order_acquire) || shm->written.load(std::memory_order_acquire) != 1) return false;
+      acquired.store(true, std::memory_order_release);
+      frame->number = ++count;
+      frame->data = shm->data;
+      frame->ground_truth = shm->ground_truth();
+      return true;
+    }
+
+    bool frame_valid(const Frame& frame) {
+      return true;
+    }
+
+    // torcs waits for the answer before it renders the next frame
+    bool newer_frame(const Frame& frame) {
+      return false;
+    }
+
+    void send_commands(const Frame& frame, const Commands& commands) {
+      override_commands(commands);
+      // release before clearing acquired, otherwise the answered frame
+      // could be acquired again while written is still 1. Waiters in
+      // wait_frame are woken up to recheck acquired, in case torcs
+      // published the next frame in between.
+      shm->release();
+      acquired.store(false, std::memory_order_release);
+      futex_wake(&shm->written);
+    }
+
+    Commands commands() {
+      return {shm->steerCmd, shm->accelCmd, shm->brakeCmd};
+    }
+
+    void override_commands(const Commands& commands) {
+      shm->steerCmd = commands.steer;
+      shm->accelCmd = commands.accel;
+      shm->brakeCmd = commands.brake;
+    }
+
+    int pause() { return shm->pause; }
+    void set_pause(int pause) { shm->pause = pause; }
+
+  protected:
+    SharedStruct* shm;
+    long poll_us, spin_us;
+    std::atomic<bool> acquired;
+    int count;
+};
+
+// FrameSource using SharedRing. Always acquires the latest frame, frames
+// that were overwritten before they were acquired are skipped.
+class RingFrameSource : public FrameSource {
+  public:
+    RingFrameSource(SharedRing* ring, long poll_us, long spin_us)
+      : ring(ring), poll_us(poll_us), spin_us(spin_us), last(0) {}
+
+    bool wait_frame(long timeout_us) {
+      return ring->wait_head(last, timeout_us, poll_us, spin_us);
+    }
+
+    bool acquire_frame(Frame* frame) {
+      int head = ring->head.load(std::memory_order_acquire);
+      if(head == last) return false;
+      SharedRingSlot& slot = ring->slot(head);
+      if(slot.frame.load(std::memory_order_acquire) != head) return false;
+      last = head;
+      frame->number = head;
+      frame->data = slot.data;
+      frame->ground_truth = slot.ground_truth;
+      return frame_valid(*frame);
+    }
+
+    bool frame_valid(const Frame& frame) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return ring->slot(frame.number).frame.load(std::memory_order_relaxed) == frame.number;
+    }
+
+    bool newer_frame(const Frame& frame) {
+      return ring->head.load(std::memory_order_acquire) > frame.number;
+    }
+
+    void send_commands(const Frame& frame, const Commands& commands) {
+      ring->write_commands(frame.number, commands);
+    }
+
+    Commands commands() {
+      int frame;
+      return ring->read_commands(&frame);
+    }
+
+    void override_commands(const Commands& commands) {
+      ring->write_commands(ring->commands_frame, commands);
+    }
+
+    int pause() { return ring->pause; }
+    void set_pause(int pause) { ring->pause = pause; }
+
+  protected:
+    SharedRing* ring;
+    long poll_us, spin_us;
+    int last;
+};
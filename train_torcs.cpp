@@ -0,0 +1,56 @@
+#include "device.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <caffe/caffe.hpp>
+
+#include <memory>
+
+DEFINE_string(solver, "network_solver.prototxt", "Prototxt describing the solver.");
+DEFINE_string(snapshot, "", "Solver state to resume training from.");
+DEFINE_string(weights, "", "Caffemodel to initialize the network with, e.g. to fine-tune a snapshot.");
+DEFINE_string(device, "auto", "Device to train on: auto, cpu, gpu or gpu:N.");
+
+
+// Train a network like `caffe train`, but with the layers of this
+// repository, e.g. FrameStoreData (see frame_store_data_layer.cpp),
+// registered with caffe.
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Train a network with the layers of torcsnet.\n"
+                          "Usage: train_torcs [FLAGS]");
+
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if(argc != 1) {
+    LOG(ERROR) << "Usage: " << argv[0] << " [FLAGS]";
+    return 1;
+  }
+  CHECK(FLAGS_snapshot.empty() || FLAGS_weights.empty()) << "Give either --snapshot or --weights, not both.";
+
+  caffe::SolverParameter solver_param;
+  caffe::ReadSolverParamsFromTextFileOrDie(FLAGS_solver, &solver_param);
+  if(select_device(FLAGS_device) == caffe::Caffe::GPU) {
+    solver_param.set_solver_mode(caffe::SolverParameter_SolverMode_GPU);
+    solver_param.set_device_id(current_gpu());
+  } else {
+    solver_param.set_solver_mode(caffe::SolverParameter_SolverMode_CPU);
+  }
+
+  std::unique_ptr<caffe::Solver<float>> solver(caffe::SolverRegistry<float>::CreateSolver(solver_param));
+  if(!FLAGS_snapshot.empty()) {
+    LOG(INFO) << "Resuming from " << FLAGS_snapshot;
+    solver->Restore(FLAGS_snapshot.c_str());
+  } else if(!FLAGS_weights.empty()) {
+    LOG(INFO) << "Initializing from " << FLAGS_weights;
+    solver->net()->CopyTrainedLayersFrom(FLAGS_weights);
+    for(const auto& test_net : solver->test_nets()) {
+      test_net->CopyTrainedLayersFrom(FLAGS_weights);
+    }
+  }
+  solver->Solve();
+  LOG(INFO) << "Optimization done.";
+
+  return 0;
+}
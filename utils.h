@@ -6,11 +6,16 @@
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 
 #include <caffe/caffe.hpp>
 
+#include <atomic>
+#include <iostream>
+#include <thread>
 
-leveldb::DB* open_leveldb_nofail(const std::string& dbname, const leveldb::Options& options)
+
+inline leveldb::DB* open_leveldb_nofail(const std::string& dbname, const leveldb::Options& options)
 {
   leveldb::DB* db;
   LOG(INFO) << "Opening " << dbname;
@@ -20,7 +25,7 @@ leveldb::DB* open_leveldb_nofail(const std::string& dbname, const leveldb::Optio
   return nullptr;
 }
 
-leveldb::DB* open_leveldb(const std::string& dbname, const leveldb::Options& options)
+inline leveldb::DB* open_leveldb(const std::string& dbname, const leveldb::Options& options)
 {
   leveldb::DB* db;
   LOG(INFO) << "Opening " << dbname;
@@ -31,7 +36,7 @@ leveldb::DB* open_leveldb(const std::string& dbname, const leveldb::Options& opt
 
 
 // convert integer to key for leveldb
-std::string key_from_int(int i) {
+inline std::string key_from_int(int i) {
   const int width = 8;
   CHECK_LE(i, (int)std::pow(10, width) - 1) <<
     "Index is too large to be compatible with the configured key format. Increase width of key.";
@@ -41,31 +46,148 @@ std::string key_from_int(int i) {
 }
 
 
+// split a comma separated list of layer names
+inline std::vector<std::string> split_layer_names(const std::string& names)
+{
+  std::vector<std::string> result;
+  std::stringstream ss(names);
+  std::string name;
+  while(std::getline(ss, name, ',')) {
+    if(!name.empty()) result.push_back(name);
+  }
+  return result;
+}
+
+
 // return (channels, height, width) of first image datum in leveldb
-std::vector<unsigned int> infer_shape(leveldb::DB* db)
+inline std::vector<unsigned int> infer_shape(leveldb::DB* db)
 {
   caffe::Datum datum;
   auto it = db->NewIterator(leveldb::ReadOptions());
   it->SeekToFirst();
+  CHECK(it->Valid()) << "Can not infer shape of empty db.";
   datum.ParseFromString(it->value().ToString());
+  delete it;
   return {(unsigned int)datum.channels(), (unsigned int)datum.height(), (unsigned int)datum.width()};
 }
 
 
 // return float_data_size of first datum in leveldb
-unsigned int infer_float_data_size(leveldb::DB* db)
+inline unsigned int infer_float_data_size(leveldb::DB* db)
 {
   caffe::Datum datum;
   auto it = db->NewIterator(leveldb::ReadOptions());
   it->SeekToFirst();
+  CHECK(it->Valid()) << "Can not infer float_data_size of empty db.";
   datum.ParseFromString(it->value().ToString());
+  delete it;
   return (unsigned int)datum.float_data_size();
 }
 
 
+// A contiguous range of keys [begin, end) of a leveldb. An empty begin is
+// the first key, an empty end is past the last key.
+struct KeyRange {
+  std::string begin;
+  std::string end;
+
+  bool contains(const leveldb::Slice& key) const {
+    return end.empty() || key.compare(end) < 0;
+  }
+};
+
+// Split the keys of db into n_shards ranges of about the same size on disk.
+// Boundaries are found by bisection on the 8 bytes following the common
+// prefix of the first and last key, using the approximate sizes leveldb
+// keeps in its index, so no values are read.
+inline std::vector<KeyRange> shard_key_range(leveldb::DB* db, int n_shards)
+{
+  CHECK(n_shards > 0) << "Need at least one shard.";
+  auto it = db->NewIterator(leveldb::ReadOptions());
+  it->SeekToFirst();
+  std::string first = it->Valid() ? it->key().ToString() : "";
+  it->SeekToLast();
+  std::string last = it->Valid() ? it->key().ToString() : "";
+  delete it;
+
+  size_t prefix_size = 0;
+  while(prefix_size < first.size() && prefix_size < last.size() && first[prefix_size] == last[prefix_size]) {
+    prefix_size += 1;
+  }
+  const std::string prefix = first.substr(0, prefix_size);
+  auto to_number = [&](const std::string& key) {
+    uint64_t number = 0;
+    for(size_t i = 0; i < 8; ++i) {
+      number = number << 8 | (prefix_size + i < key.size() ? (uint8_t)key[prefix_size + i] : 0);
+    }
+    return number;
+  };
+  auto to_key = [&](uint64_t number) {
+    std::string key = prefix;
+    for(int i = 7; i >= 0; --i) {
+      key.push_back((char)(number >> (8 * i)));
+    }
+    return key;
+  };
+  // size of the keys before key
+  auto size_before = [&](const std::string& key) {
+    leveldb::Range range(first, key);
+    uint64_t size = 0;
+    db->GetApproximateSizes(&range, 1, &size);
+    return size;
+  };
+
+  std::vector<KeyRange> shards(n_shards);
+  const uint64_t low = to_number(first), high = to_number(last);
+  const uint64_t total = size_before(last + '\0');
+  for(int i = 1; i < n_shards; ++i) {
+    uint64_t target = total / n_shards * i;
+    uint64_t a = std::max(low, to_number(shards[i - 1].begin)), b = high;
+    while(a < b) {
+      uint64_t middle = a + (b - a) / 2;
+      if(size_before(to_key(middle)) < target) {
+        a = middle + 1;
+      } else {
+        b = middle;
+      }
+    }
+    shards[i].begin = shards[i - 1].end = to_key(a);
+  }
+  shards[0].begin = "";
+  // if leveldb reports no sizes, e.g. for dbs that fit into its write
+  // buffer, most keys end up in the last shard
+  return shards;
+}
+
+// Run process(shard) for every shard on n_threads threads.
+template <class Process>
+void for_each_shard(const std::vector<KeyRange>& shards, int n_threads, Process process) {
+  std::atomic<unsigned int> next_shard(0);
+  std::vector<std::thread> threads;
+  for(int i = 0; i < n_threads; ++i) {
+    threads.emplace_back([&]() {
+      for(unsigned int shard = next_shard++; shard < shards.size(); shard = next_shard++) {
+        process(shards[shard]);
+      }
+    });
+  }
+  for(auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// count processed entries over all threads and report progress
+inline void count_processed(std::atomic<unsigned int>& count) {
+  unsigned int previous = count.fetch_add(1, std::memory_order_relaxed);
+  if(previous % 5000 == 0) {
+    std::cout << "Processed " << previous << " entries." << std::endl;
+  }
+}
+
+
 // copy datum image (channel, height, width) into IplImage (height, width,
 // channel)
-void datum_to_ipl(const caffe::Datum& datum, IplImage* img)
+inline void datum_to_ipl(const caffe::Datum& datum, IplImage* img)
 {
   unsigned int n_channels = datum.channels(),
                height = datum.height(),
@@ -90,7 +212,8 @@ void datum_to_ipl(const caffe::Datum& datum, IplImage* img)
 // Initialized with filename of binary protobuf file containing a BlobProto
 // that has as many rows as the blob has elements and two columns containing
 // the slope and bias of the linear transformation to normalize the entry.
-// See normalize.cpp where such a normalization is calculated.
+// Blobs holding a batch of several such vectors are (de-)normalized row by
+// row. See normalize.cpp where such a normalization is calculated.
 template <class Dtype>
 class LinearNormalizer {
   public:
@@ -107,8 +230,9 @@ class LinearNormalizer {
       check_blob(blob);
       Dtype* input = blob->mutable_cpu_data();
       const Dtype* normalization_params = normalization_blob.cpu_data();
-      for(unsigned int i = 0; i < normalization_blob.shape(0); ++i) {
-        input[i] = normalization_params[i*2 + 0] * input[i] + normalization_params[i*2 + 1];
+      const int rows = normalization_blob.shape(0);
+      for(int i = 0; i < blob->count(); ++i) {
+        input[i] = normalization_params[(i % rows)*2 + 0] * input[i] + normalization_params[(i % rows)*2 + 1];
       }
     }
 
@@ -117,15 +241,85 @@ class LinearNormalizer {
       check_blob(blob);
       Dtype* input = blob->mutable_cpu_data();
       const Dtype* normalization_params = normalization_blob.cpu_data();
-      for(unsigned int i = 0; i < normalization_blob.shape(0); ++i) {
-        input[i] = (input[i] - normalization_params[i*2 + 1]) / normalization_params[i*2 + 0];
+      const int rows = normalization_blob.shape(0);
+      for(int i = 0; i < blob->count(); ++i) {
+        input[i] = (input[i] - normalization_params[(i % rows)*2 + 1]) / normalization_params[(i % rows)*2 + 0];
       }
     }
 
   protected:
     void check_blob(const caffe::Blob<Dtype>* blob) {
-      CHECK(blob->count() == normalization_blob.shape(0)) << "Input blob must have as many elements as normalization blob has rows.";
+      CHECK(blob->count() > 0 && blob->count() % normalization_blob.shape(0) == 0) <<
+        "Input blob must have a multiple of as many elements as normalization blob has rows.";
     }
 
     caffe::Blob<Dtype> normalization_blob;
 };
+
+
+// Name of the layer appended by fold_normalization.cpp. Networks that have
+// it output denormalized values and need no LinearNormalizer.
+const std::string folded_normalization_layer = "denormalize";
+
+inline bool has_folded_normalization(const caffe::Net<float>& net)
+{
+  return net.has_layer(folded_normalization_layer);
+}
+
+
+// Mean and scale of a TransformationParameter, prepared once such that
+// inputs can be transformed without going through caffe::Datum and
+// caffe::DataTransformer. The mean is expanded to a full (channels, height,
+// width) image. A mean image of a different size is resized bilinearly.
+// Cropping and mirroring are not supported.
+template <class Dtype>
+class InputTransformation {
+  public:
+    InputTransformation(const caffe::TransformationParameter& param, int channels, int height, int width)
+      : scale_(param.scale()), mean_(channels * height * width, Dtype(0))
+    {
+      CHECK(param.crop_size() == 0) << "Cropping is not supported.";
+      CHECK(!param.mirror()) << "Mirroring is not supported.";
+      CHECK(!(param.has_mean_file() && param.mean_value_size() > 0)) << "Specify either mean_file or mean_value, not both.";
+
+      const int plane = height * width;
+      if(param.has_mean_file()) {
+        caffe::BlobProto mean_blob_proto;
+        ReadProtoFromBinaryFileOrDie(param.mean_file(), &mean_blob_proto);
+        caffe::Blob<float> mean_blob;
+        mean_blob.FromProto(mean_blob_proto);
+        CHECK(mean_blob.channels() == channels) << "Mean image has " << mean_blob.channels() << " channels, expected " << channels << ".";
+        const int mean_height = mean_blob.height(),
+                  mean_width = mean_blob.width();
+        if(mean_height != height || mean_width != width) {
+          LOG(INFO) << "Resizing mean image from " << mean_width << "x" << mean_height << " to " << width << "x" << height;
+        }
+        for(int c = 0; c < channels; ++c) {
+          cv::Mat channel_mean(mean_height, mean_width, CV_32FC1,
+                               (void*)(mean_blob.cpu_data() + c * mean_height * mean_width));
+          if(mean_height != height || mean_width != width) {
+            cv::Mat resized;
+            cv::resize(channel_mean, resized, cv::Size(width, height), 0, 0, cv::INTER_LINEAR);
+            channel_mean = resized;
+          }
+          for(int i = 0; i < plane; ++i) {
+            mean_[c * plane + i] = ((const float*)channel_mean.data)[i];
+          }
+        }
+      } else if(param.mean_value_size() > 0) {
+        CHECK(param.mean_value_size() == 1 || param.mean_value_size() == channels) <<
+          "Specify either one mean value or as many as channels.";
+        for(int c = 0; c < channels; ++c) {
+          Dtype value = param.mean_value(param.mean_value_size() == 1 ? 0 : c);
+          std::fill(mean_.begin() + c * plane, mean_.begin() + (c + 1) * plane, value);
+        }
+      }
+    }
+
+    const Dtype* mean() const { return mean_.data(); }
+    Dtype scale() const { return scale_; }
+
+  protected:
+    Dtype scale_;
+    std::vector<Dtype> mean_;
+};
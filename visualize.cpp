@@ -1,4 +1,5 @@
 #include "utils.h"
+#include "datum_codec.h"
 
 #include <iostream>
 
@@ -25,12 +26,13 @@ int main(int argc, char** argv) {
   caffe::Datum datum;
   IplImage* windowImg = cvCreateImage(cvSize(shape[2], shape[1]), IPL_DEPTH_8U, shape[0]);
 
-  auto it = db->NewIterator(leveldb::ReadOptions());
+  // frames are decoded ahead on all cores
+  DatumReader reader(db);
+  std::string db_key;
   unsigned int count = 0;
-  for(it->SeekToFirst(); it->Valid(); it->Next())
+  while(reader.next(&db_key, &datum))
   {
     count += 1;
-    datum.ParseFromString(it->value().ToString());
     datum_to_ipl(datum, windowImg);
     // use a constant name for the window otherwise a new window is created on each call
     cvShowImage(dbname.c_str(), windowImg);
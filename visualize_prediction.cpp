@@ -1,10 +1,13 @@
 #include "utils.h"
+#include "device.h"
+#include "datum_codec.h"
 
 #include <caffe/data_transformer.hpp>
 
 #include <gflags/gflags.h>
 
 #include <iostream>
+#include <memory>
 
 const int n_outputs = 15;
 
@@ -23,6 +26,9 @@ DEFINE_string(network_caffemodel, "network_weights.caffemodel", "Caffemodel with
 DEFINE_string(normalization_protobinary, "torcs_train_normalization.binaryproto", "Protobinary containing Blob with normalization parameters.");
 
 DEFINE_int32(start_frame, 0, "Frame to start with.");
+DEFINE_string(device, "auto", "Device to run the network on: auto, cpu, gpu or gpu:N.");
+DEFINE_int32(threads, 0, "Number of BLAS/OpenMP threads used for inference on the CPU. 0 uses the library default.");
+DEFINE_int32(decode_threads, 0, "Number of threads reading and decoding frames ahead. 0 to use the number of cores.");
 
 // Show frames in leveldb
 int main(int argc, char** argv) {
@@ -31,12 +37,8 @@ int main(int argc, char** argv) {
   google::InitGoogleLogging(argv[0]);
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 
-  // TODO currently this is hardcoded to use GPU 0 but it should try to
-  // detect if there is a GPU and which one is best to use.
-  const int gpu_idx = 0;
-  caffe::Caffe::SetDevice(gpu_idx);
-  caffe::Caffe::DeviceQuery();
-  caffe::Caffe::set_mode(caffe::Caffe::GPU);
+  select_device(FLAGS_device);
+  set_compute_threads(FLAGS_threads);
 
   // open db
   std::string dbname(FLAGS_dbname);
@@ -86,19 +88,21 @@ int main(int argc, char** argv) {
   // Data transformer
   auto transformation_param = network.layers()[0]->layer_param().transform_param();
   caffe::DataTransformer<float> transformer(transformation_param, caffe::TEST);
-  // Data normalizer
-  std::string normalization_fname(FLAGS_normalization_protobinary);
-  LinearNormalizer<float> normalizer(normalization_fname);
+  // Data normalizer, not needed if the network denormalizes itself
+  std::unique_ptr<LinearNormalizer<float>> normalizer;
+  if(!has_folded_normalization(network)) {
+    std::string normalization_fname(FLAGS_normalization_protobinary);
+    normalizer.reset(new LinearNormalizer<float>(normalization_fname));
+  }
 
-  // iterate
-  auto it = db->NewIterator(leveldb::ReadOptions());
-  it->Seek(key_from_int(FLAGS_start_frame));
+  // iterate, frames are decoded ahead
+  DatumReader reader(db, FLAGS_decode_threads, key_from_int(FLAGS_start_frame));
+  std::string db_key;
   unsigned int count = 0;
   unsigned int info_iter = 10;
   unsigned int wait_ms = 100;
-  for(; it->Valid(); it->Next())
+  while(reader.next(&db_key, &datum))
   {
-    datum.ParseFromString(it->value().ToString());
 
     // clear window
     cvSet(windowImg, cvScalar(0,0,0));
@@ -108,7 +112,7 @@ int main(int argc, char** argv) {
     // predict current frame
     transformer.Transform(datum, input_blob);
     network.Forward();
-    normalizer.Denormalize(output_blob);
+    if(normalizer) normalizer->Denormalize(output_blob);
 
     // raw output data
     const float* output_data = output_blob->cpu_data();
@@ -121,7 +125,7 @@ int main(int argc, char** argv) {
     // ground truth if available
     if(db_groundtruth != nullptr) {
       std::string gt_value;
-      auto status = db_groundtruth->Get(leveldb::ReadOptions(), it->key(), &gt_value);
+      auto status = db_groundtruth->Get(leveldb::ReadOptions(), db_key, &gt_value);
       CHECK(status.ok()) << status.ToString();
       caffe::Datum gt_datum;
       gt_datum.ParseFromString(gt_value);
@@ -146,20 +150,27 @@ int main(int argc, char** argv) {
         wait_ms = std::max((int)wait_ms - 10, 1);
       } else if(val->second == "slow_down") {
         wait_ms = wait_ms + 10;
-      } else if(val->second == "jump_hundred_forward") {
-        for(int i = 0; i < 100; ++i) {
-          if(!it->Valid()) break;
-          it->Next();
+      } else if(val->second == "jump_hundred_forward" || val->second == "jump_hundred_back") {
+        // find the key to continue with and restart reading there
+        auto it = db->NewIterator(leveldb::ReadOptions());
+        it->Seek(db_key);
+        for(int i = 0; i < 100 && it->Valid(); ++i) {
+          if(val->second == "jump_hundred_forward") it->Next();
+          else it->Prev();
         }
-      } else if(val->second == "jump_hundred_back") {
-        for(int i = 0; i < 100; ++i) {
-          if(!it->Valid()) break;
-          it->Prev();
+        if(it->Valid()) {
+          reader.seek(it->key().ToString());
+        } else if(val->second == "jump_hundred_back") {
+          reader.seek("");
+        } else {
+          delete it;
+          break;
         }
+        delete it;
       }
     }
 
-    if(count % info_iter == 0) std::cout << "Frame: " << it->key().ToString() << std::endl;
+    if(count % info_iter == 0) std::cout << "Frame: " << db_key << std::endl;
   }
   std::cout << "Played a total of " << count << " keys." << std::endl;
 